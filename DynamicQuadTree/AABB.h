@@ -10,6 +10,7 @@
 #define AABB_h
 
 #include <float.h>
+#include <algorithm>
 #include "vec2.h"
 
 struct AABB
@@ -74,6 +75,29 @@ inline bool touches(const AABB& a, const AABB& b, float r)
     return d1.x <= r && d1.y <= r && d2.x <= r && d2.y <= r;
 }
 
+// Slab test of origin + t * dir against aabb for t in [0, maxT]; t receives the entry parameter.
+// invDir may hold infinities for axis-aligned rays.
+inline bool raycast(const AABB& aabb, const vec2& origin, const vec2& invDir, float maxT, float& t)
+{
+    float t0 = 0.0f;
+    float t1 = maxT;
+    
+    float u = (aabb.lowerBound.x - origin.x) * invDir.x;
+    float v = (aabb.upperBound.x - origin.x) * invDir.x;
+    if(u > v) std::swap(u, v);
+    t0 = std::max(t0, u);
+    t1 = std::min(t1, v);
+    
+    u = (aabb.lowerBound.y - origin.y) * invDir.y;
+    v = (aabb.upperBound.y - origin.y) * invDir.y;
+    if(u > v) std::swap(u, v);
+    t0 = std::max(t0, u);
+    t1 = std::min(t1, v);
+    
+    t = t0;
+    return t0 <= t1;
+}
+
 float distSq(const AABB& a, const AABB& b)
 {
     vec2 ub = max(0.0f, a.lowerBound - b.upperBound);
@@ -0,0 +1,279 @@
+//
+//  AdaptiveIndex.h
+//  DynamicQuadTree
+//
+
+#ifndef AdaptiveIndex_h
+#define AdaptiveIndex_h
+
+#include <chrono>
+#include <memory>
+#include "DynamicQuadTree.h"
+#include "DynamicHashGrid.h"
+
+template <class T>
+struct _positionOf
+{
+    inline vec2 operator () (const T* ptr) const
+    {
+        return ptr->p;
+    }
+};
+
+// Rebuilt-every-frame front-end over DynamicQuadTree and DynamicHashGrid that picks the
+// backend and cell size (h/2, h or 2h) per frame. Each configuration keeps a running
+// average of its build + solve time and the cheapest one is used. Every `period` frames
+// one frame is sampled for occupancy and the candidate/accept ratio, and those decide
+// which other configuration gets a one-frame probe next. Every pair within h, coincident
+// points included, is still handed to the solver exactly once, but coarser cells hand over
+// more rejects, so solvers must check distances and ignore a == b as with DynamicQuadTree.
+template <class T, class _Position = _positionOf<T>>
+class AdaptiveIndex
+{
+
+public:
+
+    enum Backend
+    {
+        tree,
+        grid
+    };
+
+    struct Config
+    {
+        Backend backend;
+        float scale;
+    };
+
+    struct Stats
+    {
+        int config;
+        qt_int particles;
+        qt_int cells;
+        float occupancy;
+        size_t candidates;
+        size_t accepted;
+        float ratio;
+        float ms;
+    };
+
+    static const int configs = 5;
+
+protected:
+
+    std::unique_ptr<DynamicQuadTree<T>> trees[2];
+    std::unique_ptr<DynamicHashGrid<T>> grids[3];
+
+    _Position position;
+    float h;
+
+    int current;
+    int frame;
+    int probes;
+    bool sampling;
+
+    // Running average frame time per configuration, negative until measured.
+    float cost[configs];
+
+    Stats sample;
+    qt_int particles;
+    float ms;
+
+    std::chrono::steady_clock::time_point start;
+
+    static inline const Config& config_at(int i)
+    {
+        // The h/2 cells need the wider stencil only DynamicHashGrid has.
+        static const Config table[configs] = {
+            { tree, 1.0f },
+            { tree, 2.0f },
+            { grid, 0.5f },
+            { grid, 1.0f },
+            { grid, 2.0f }
+        };
+        return table[i];
+    }
+
+    static inline int find(Backend backend, float scale)
+    {
+        for(int i = 0; i < configs; ++i)
+            if(config_at(i).backend == backend && config_at(i).scale == scale)
+                return i;
+        return -1;
+    }
+
+    inline DynamicQuadTree<T>& tree_at(int c) {
+        int i = c;
+        if(!trees[i])
+            trees[i].reset(new DynamicQuadTree<T>(h * config_at(c).scale));
+        return *trees[i];
+    }
+
+    inline DynamicHashGrid<T>& grid_at(int c) {
+        int i = c - 2;
+        if(!grids[i]) {
+            float s = config_at(c).scale;
+            if(s < 1.0f)
+                grids[i].reset(new DynamicHashGrid<T>(h, (int)(1.0f / s)));
+            else
+                grids[i].reset(new DynamicHashGrid<T>(h * s));
+        }
+        return *grids[i];
+    }
+
+    inline qt_int cells() {
+        if(config_at(current).backend == tree)
+            return tree_at(current).leaf_count();
+        return grid_at(current).cell_count();
+    }
+
+    inline int best() const
+    {
+        int b = current;
+        for(int i = 0; i < configs; ++i)
+            if(cost[i] >= 0.0f && (cost[b] < 0.0f || cost[i] < cost[b] * hysteresis))
+                b = i;
+        return b;
+    }
+
+    // The configuration the last sample argues for: smaller cells when most candidates are
+    // rejects, larger ones when cells hold too few particles to pay for their overhead,
+    // otherwise the other backend at the same size.
+    int suggest() {
+        const Config& c = config_at(sample.config);
+        float waste = sample.particles > 0 ? (sample.candidates - sample.accepted) / (float)sample.particles : 0.0f;
+
+        int k[3];
+        int n = 0;
+
+        if(waste > wasteLimit) {
+            int i = find(c.backend, c.scale * 0.5f);
+            if(i == -1) i = find(grid, c.scale * 0.5f);
+            if(i != -1) k[n++] = i;
+        }
+
+        if(sample.occupancy < occupancyLimit) {
+            int i = find(c.backend, c.scale * 2.0f);
+            if(i != -1) k[n++] = i;
+        }
+
+        int i = find(c.backend == tree ? grid : tree, c.scale);
+        if(i != -1) k[n++] = i;
+
+        return n > 0 ? k[probes++ % n] : sample.config;
+    }
+
+    // Sampled frames pay for the counting, so they are left out of the averages.
+    void commit() {
+        if(frame == 0 || sampling) return;
+
+        float& c = cost[current];
+        c = c < 0.0f ? ms : c + smoothing * (ms - c);
+    }
+
+public:
+
+    // Sample and probe every `period` (at least 3) frames.
+    int period;
+
+    // Rejected candidates per particle above which smaller cells are probed.
+    float wasteLimit;
+
+    // Particles per occupied cell below which larger cells are probed.
+    float occupancyLimit;
+
+    // A configuration must be this much cheaper to replace the current one.
+    float hysteresis;
+
+    float smoothing;
+
+    AdaptiveIndex(float h, _Position position = _Position()) : position(position), h(h), current(0), frame(0), probes(0), sampling(false), particles(0), ms(0.0f), period(8), wasteLimit(16.0f), occupancyLimit(1.5f), hysteresis(0.95f), smoothing(0.25f) {
+        for(int i = 0; i < configs; ++i)
+            cost[i] = -1.0f;
+        sample = Stats();
+    }
+
+    // Starts a frame: folds the last frame's time in and picks the configuration to build.
+    void clear() {
+        commit();
+
+        int f = frame++;
+        current = f % period == 2 ? suggest() : best();
+        sampling = f % period == 1;
+
+        if(config_at(current).backend == tree)
+            tree_at(current).clear();
+        else
+            grid_at(current).clear();
+
+        particles = 0;
+        start = std::chrono::steady_clock::now();
+    }
+
+    inline void insert_pointer(T* ptr, const vec2& p) {
+        ++particles;
+        if(config_at(current).backend == tree)
+            tree_at(current).insert_pointer(ptr, p);
+        else
+            grid_at(current).insert_pointer(ptr, p);
+    }
+
+    template <class _Solver>
+    void solve(_Solver solver) {
+        size_t candidates = 0;
+        size_t accepted = 0;
+        float h2 = h * h;
+
+        auto counted = [&] (T* a, T* b) {
+            if(a != b) {
+                ++candidates;
+                if(distSq(position(a), position(b)) <= h2)
+                    ++accepted;
+            }
+            solver(a, b);
+        };
+
+        if(config_at(current).backend == tree) {
+            if(sampling)
+                tree_at(current).solve(counted);
+            else
+                tree_at(current).solve(solver);
+        }else{
+            if(sampling)
+                grid_at(current).solve(counted);
+            else
+                grid_at(current).solve(solver);
+        }
+
+        ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if(sampling) {
+            sample.config = current;
+            sample.particles = particles;
+            sample.cells = cells();
+            sample.occupancy = sample.cells > 0 ? particles / (float)sample.cells : 0.0f;
+            sample.candidates = candidates;
+            sample.accepted = accepted;
+            sample.ratio = candidates > 0 ? accepted / (float)candidates : 0.0f;
+            sample.ms = ms;
+        }
+    }
+
+    inline const Config& config() const
+    {
+        return config_at(current);
+    }
+
+    // Figures of the last sampled frame.
+    inline const Stats& stats() const
+    {
+        return sample;
+    }
+
+    inline float average_ms(int config) const
+    {
+        return cost[config];
+    }
+};
+
+#endif /* AdaptiveIndex_h */
@@ -0,0 +1,334 @@
+//
+//  DomainDecomposition.h
+//  DynamicQuadTree
+//
+
+#ifndef DomainDecomposition_h
+#define DomainDecomposition_h
+
+#include <mutex>
+#include <algorithm>
+#include "DynamicQuadTree.h"
+
+// Moves ghost particles between ranks. send may be called from any rank; receive hands a
+// rank everything sent to it since its last receive.
+template <class T>
+class GhostTransport
+{
+
+public:
+
+    virtual ~GhostTransport() {}
+
+    virtual void send(int from, int to, const T* data, size_t count) = 0;
+
+    virtual void receive(int to, std::vector<T>& out) = 0;
+};
+
+// In-process stand-in: one mailbox per rank, safe to use with one thread per rank.
+template <class T>
+class LocalGhostTransport : public GhostTransport<T>
+{
+
+protected:
+
+    std::vector<std::vector<T>> boxes;
+    std::mutex mutex;
+
+public:
+
+    LocalGhostTransport(int ranks) : boxes(ranks) {}
+
+    void send(int, int to, const T* data, size_t count) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        boxes[to].insert(boxes[to].end(), data, data + count);
+    }
+
+    void receive(int to, std::vector<T>& out) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        out.insert(out.end(), boxes[to].begin(), boxes[to].end());
+        boxes[to].clear();
+    }
+};
+
+// Splits the bounds of a DynamicQuadTree into a 2^depth x 2^depth grid of cells and gives
+// every rank a contiguous range of their Morton keys, either one top-level quadrant each
+// or balanced by particle count. The grid is frozen by frame() and positions outside it
+// belong to the nearest edge cell. In one process partition(tree) does both steps; across
+// processes every rank calls frame() with the union of all tree bounds and partition() with
+// the concatenation of all census() results, so all ranks compute the same table.
+template <class T>
+class DomainDecomposition
+{
+
+public:
+
+    enum Split
+    {
+        quadrants,
+        morton
+    };
+
+    struct Region
+    {
+        uint64_t begin;
+        uint64_t end;
+        AABB bounds;
+        qt_int count;
+    };
+
+protected:
+
+    int ranks;
+    float h;
+    Split split;
+
+    AABB bounds;
+    float cellSize;
+    qt_int depth;
+
+    std::vector<Region> regions;
+
+    static inline uint64_t spread(uint32_t x)
+    {
+        uint64_t v = x;
+        v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    }
+
+    static inline uint32_t compact(uint64_t v)
+    {
+        v &= 0x5555555555555555ull;
+        v = (v | (v >> 1)) & 0x3333333333333333ull;
+        v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0full;
+        v = (v | (v >> 4)) & 0x00ff00ff00ff00ffull;
+        v = (v | (v >> 8)) & 0x0000ffff0000ffffull;
+        v = (v | (v >> 16)) & 0x00000000ffffffffull;
+        return (uint32_t)v;
+    }
+
+    inline int cell_coord(float x, float lo) const
+    {
+        int side = 1 << depth;
+        int i = (int)floorf((x - lo) / cellSize);
+        return std::min(std::max(i, 0), side - 1);
+    }
+
+    inline AABB cell(int x, int y) const
+    {
+        vec2 lo(bounds.lowerBound.x + x * cellSize, bounds.lowerBound.y + y * cellSize);
+        return AABB(lo, lo + cellSize);
+    }
+
+    // Every position that belongs to cell (x, y): its box, open past the edges of the grid.
+    inline AABB domain(int x, int y) const
+    {
+        int side = 1 << depth;
+        AABB c = cell(x, y);
+        if(x == 0) c.lowerBound.x = -FLT_MAX;
+        if(y == 0) c.lowerBound.y = -FLT_MAX;
+        if(x == side - 1) c.upperBound.x = FLT_MAX;
+        if(y == side - 1) c.upperBound.y = FLT_MAX;
+        return c;
+    }
+
+    inline uint64_t key(const vec2& p) const
+    {
+        return spread(cell_coord(p.x, bounds.lowerBound.x)) | (spread(cell_coord(p.y, bounds.lowerBound.y)) << 1);
+    }
+
+    // Sorts (key, count) pairs and sums the counts of equal keys.
+    static void merge(std::vector<std::pair<uint64_t, qt_int>>& occupied)
+    {
+        std::sort(occupied.begin(), occupied.end());
+        size_t m = 0;
+        for(size_t i = 0; i < occupied.size(); ++i) {
+            if(m > 0 && occupied[m - 1].first == occupied[i].first)
+                occupied[m - 1].second += occupied[i].second;
+            else
+                occupied[m++] = occupied[i];
+        }
+        occupied.resize(m);
+    }
+
+    // Region ends never decrease, so the owner is the first region ending past k.
+    inline int owner(uint64_t k) const
+    {
+        auto it = std::upper_bound(regions.begin(), regions.end(), k, [] (uint64_t k, const Region& r) { return k < r.end; });
+        return std::min((int)(it - regions.begin()), ranks - 1);
+    }
+
+public:
+
+    DomainDecomposition(int ranks, float h, Split split = morton) : ranks(ranks), h(h), split(split), cellSize(h), depth(0), regions(ranks) {}
+
+    // Freezes the grid over `box`, squared up from its lower corner. Every rank must pass
+    // the same box, e.g. the union of all ranks' tree bounds.
+    void frame(const AABB& box) {
+        float extent = std::max(box.upperBound.x - box.lowerBound.x, box.upperBound.y - box.lowerBound.y);
+        bounds = AABB(box.lowerBound, box.lowerBound + extent);
+
+        if(split == quadrants) {
+            depth = 1;
+        }else{
+            depth = 5;
+            while((1 << (2 * (depth - 5))) < ranks) ++depth;
+        }
+
+        // No finer than h.
+        qt_int fit = 0;
+        while(fit < 16 && h * (float)(1 << fit) < extent) ++fit;
+
+        depth = std::min(depth, fit);
+        cellSize = extent / (1 << depth);
+    }
+
+    // This tree's particle count per occupied cell of the frozen grid, sorted by key.
+    // Outliers count towards the edge cells they are clamped to.
+    std::vector<std::pair<uint64_t, qt_int>> census(const DynamicQuadTree<T>& tree) const
+    {
+        std::vector<std::pair<uint64_t, qt_int>> occupied;
+        tree.cells(depth, [this, &occupied] (const AABB& aabb, qt_int count) {
+            occupied.push_back(std::make_pair(key(aabb.center()), count));
+        });
+
+        tree.overflowed([this, &occupied] (T*, const vec2& p) {
+            occupied.push_back(std::make_pair(key(p), 1));
+        });
+
+        merge(occupied);
+        return occupied;
+    }
+
+    // Assigns the key ranges from per-cell counts, which may be the concatenated census()
+    // of every rank; the same counts give every rank the same table.
+    void partition(std::vector<std::pair<uint64_t, qt_int>> occupied) {
+        merge(occupied);
+
+        uint64_t keys = (uint64_t)1 << (2 * depth);
+
+        for(Region& r : regions) {
+            r.begin = r.end = keys;
+            r.count = 0;
+            r.bounds = AABB(vec2(FLT_MAX), vec2(-FLT_MAX));
+        }
+
+        if(split == quadrants) {
+            for(int r = 0; r < ranks; ++r) {
+                regions[r].begin = (keys * r) / std::min(ranks, 4);
+                regions[r].end = (keys * (r + 1)) / std::min(ranks, 4);
+                if(r >= 4) regions[r].begin = regions[r].end = keys;
+            }
+        }else{
+            qt_int total = 0;
+            for(auto& e : occupied) total += e.second;
+
+            int r = 0;
+            qt_int acc = 0;
+            regions[0].begin = 0;
+            for(auto& e : occupied) {
+                while(r + 1 < ranks && (int64_t)acc * ranks >= (int64_t)total * (r + 1)) {
+                    regions[r].end = e.first;
+                    regions[++r].begin = e.first;
+                }
+                acc += e.second;
+            }
+            regions[r].end = keys;
+        }
+
+        for(auto& e : occupied) {
+            Region& r = regions[owner(e.first)];
+            r.count += e.second;
+            AABB aabb = cell(compact(e.first), compact(e.first >> 1));
+            r.bounds.add(aabb);
+        }
+    }
+
+    // Single-process shortcut: the grid and the counts both come from `tree`.
+    void partition(const DynamicQuadTree<T>& tree) {
+        frame(tree.bounds());
+        partition(census(tree));
+
+        tree.overflowed([this] (T*, const vec2& p) {
+            regions[owner(p)].bounds.add(p);
+        });
+    }
+
+    inline const Region& region(int rank) const
+    {
+        return regions[rank];
+    }
+
+    inline int owner(const vec2& p) const
+    {
+        return owner(key(p));
+    }
+
+    // Calls callback(to, T*) for every particle of `rank` in `tree` within h of a cell owned
+    // by another rank `to`. Only the strips along the region's edges are queried; those of
+    // edge cells run out past the grid, where clamped outliers live.
+    template <class _Position, class _Callback>
+    void ghosts(DynamicQuadTree<T>& tree, int rank, _Position position, _Callback callback) {
+        const Region& own = regions[rank];
+
+        std::vector<std::vector<T*>> out(ranks);
+
+        for(uint64_t k = own.begin; k < own.end; ++k) {
+            int x = compact(k);
+            int y = compact(k >> 1);
+            AABB c = domain(x, y);
+
+            for(int dy = -1; dy <= 1; ++dy) {
+                for(int dx = -1; dx <= 1; ++dx) {
+                    int nx = x + dx;
+                    int ny = y + dy;
+                    if((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= (1 << depth) || ny >= (1 << depth)) continue;
+
+                    int to = owner(spread(nx) | (spread(ny) << 1));
+                    if(to == rank) continue;
+
+                    AABB n = domain(nx, ny);
+                    AABB strip(max(c.lowerBound, n.lowerBound - h), min(c.upperBound, n.upperBound + h));
+
+                    tree.query(strip, [&] (T* ptr) {
+                        vec2 p = position(ptr);
+                        if(owner(p) == rank && distSq(p, n) <= h * h)
+                            out[to].push_back(ptr);
+                    });
+                }
+            }
+        }
+
+        for(int to = 0; to < ranks; ++to) {
+            std::sort(out[to].begin(), out[to].end());
+            out[to].erase(std::unique(out[to].begin(), out[to].end()), out[to].end());
+            for(T* ptr : out[to])
+                callback(to, ptr);
+        }
+    }
+
+    // Sends copies of this rank's ghosts to the ranks that need them.
+    template <class _Position>
+    void export_ghosts(DynamicQuadTree<T>& tree, int rank, _Position position, GhostTransport<T>& transport) {
+        std::vector<std::vector<T>> out(ranks);
+
+        ghosts(tree, rank, position, [&out] (int to, T* ptr) {
+            out[to].push_back(*ptr);
+        });
+
+        for(int to = 0; to < ranks; ++to)
+            if(!out[to].empty())
+                transport.send(rank, to, out[to].data(), out[to].size());
+    }
+
+    // Appends the ghosts other ranks sent to `rank`; insert them into its tree before solve.
+    void import_ghosts(int rank, GhostTransport<T>& transport, std::vector<T>& out) {
+        transport.receive(rank, out);
+    }
+};
+
+#endif /* DomainDecomposition_h */
@@ -10,7 +10,10 @@
 #define DynamicHashGrid_h
 
 #include <vector>
-#include "AABB.h"
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include "vec2simd.h"
 
 struct _gridHasher
 {
@@ -20,7 +23,7 @@ struct _gridHasher
     }
 };
 
-template <class T, int N = 16777216, class _Hasher = _gridHasher>
+template <class T, int N = 16777216, class _Hasher = _gridHasher, class _Less = std::less<const T*>>
 class DynamicHashGrid
 {
     
@@ -36,6 +39,8 @@ protected:
     {
         std::vector<Pptr> data;
         AABB aabb;
+        int stamp;
+        int slot;
         
         inline void add(T* ptr, const vec2& _p) {
             data.push_back(Pptr{ptr, _p});
@@ -50,13 +55,66 @@ protected:
     std::vector<Node> data;
     int grid[N];
     _Hasher hasher;
+    _Less less;
     float h;
     
+    // Cells are h / reach wide; solve looks `reach` cells out.
+    int reach;
+    float cell;
+    
+    AABB aabb;
+    int rays;
+    
+    bool canonical;
+    
+    // Orders the nodes by grid slot and their points by _Less, which makes the solve order
+    // independent of insertion order.
+    void canonicalize() {
+        std::sort(data.begin(), data.end(), [] (const Node& a, const Node& b) { return a.slot < b.slot; });
+        
+        for(int i = 0; i < (int)data.size(); ++i) {
+            Node& n = data[i];
+            grid[n.slot] = i;
+            std::sort(n.data.begin(), n.data.end(), [this] (const Pptr& a, const Pptr& b) { return less(a.ptr, b.ptr); });
+        }
+        
+        canonical = true;
+    }
+    
+    template <class _Callback>
+    inline void raycast_cell(int x, int y, const vec2& origin, const vec2& invDir, float r, float& maxT, _Callback& callback) {
+        int k = grid[hasher(x, y)%N];
+        if(k == -1) return;
+        
+        Node& n = data[k];
+        if(n.stamp == rays) return;
+        n.stamp = rays;
+        
+        AABB box = n.aabb;
+        box.extend(r);
+        
+        float t;
+        if(!::raycast(box, origin, invDir, maxT, t)) return;
+        
+        for(Pptr& e : n.data) {
+            box.set(e.p);
+            box.extend(r);
+            if(::raycast(box, origin, invDir, maxT, t))
+                maxT = callback(e.ptr, maxT);
+        }
+    }
+    
 public:
     
     bool null;
     
-    DynamicHashGrid(float h) : h(h), null(true) {
+    // When set, solve visits pairs in an order fixed by the positions and _Less alone, so
+    // accumulations are bitwise reproducible across insertion orders. The default _Less
+    // compares addresses, so runs only repeat when the particles live in one array in a
+    // fixed order; otherwise pass a _Less on a stable id.
+    bool deterministic;
+    
+    DynamicHashGrid(float h, int reach = 1) : h(h), reach(reach), cell(h / reach), rays(0), canonical(true), null(true), deterministic(false) {
         for(int i = 0; i < N; ++i) {
             grid[i] = -1;
         }
@@ -68,16 +126,24 @@ public:
         }
     }
     
+    // Only the slots in use are reset.
     inline void clear() {
+        for(Node& n : data)
+            grid[n.slot] = -1;
         data.clear();
-        for(int i = 0; i < N; ++i) {
-            grid[i] = -1;
-        }
+        null = true;
+        canonical = true;
+    }
+    
+    inline int cell_count() const
+    {
+        return (int)data.size();
     }
     
     template <class _Solver>
     void solve(_Solver solver) {
-        static const int nk = 12;
+        // Own row and the `reach` rows above; the ordering test below drops the other half.
+        static const int nk = 2 * 6;
         static const int k[nk] = {
             -1, 0,
             0, 0,
@@ -87,39 +153,157 @@ public:
             1, 1
         };
         
+        std::vector<int> stencil;
+        const int* ks = k;
+        int ns = nk;
+        
+        if(reach > 1) {
+            for(int y = 0; y <= reach; ++y) {
+                for(int x = -reach; x <= reach; ++x) {
+                    stencil.push_back(x);
+                    stencil.push_back(y);
+                }
+            }
+            ks = stencil.data();
+            ns = (int)stencil.size();
+        }
+        
         size_t hash;
         
+        if(deterministic && !canonical)
+            canonicalize();
+        
         for(Node& x : data) {
             int xs = x.count();
             for(int w = 0; w < xs; ++w) {
                 vec2& p = x.data[w].p;
-                int ix = p.x/h;
-                int iy = p.y/h;
-                for(int i = 0; i < nk; i += 2) {
-                    hash = hasher(ix + k[i], iy + k[i + 1]);
-                    int& cell = grid[hash%N];
-                    if(cell == -1) continue;
-                    if(!data[cell].aabb.covers(p, h)) continue;
-                    int cs = data[cell].count();
-                    for(int q = 0; q < cs; ++q) {
-                        vec2& e = data[cell].data[q].p;
-                        if(e.y > p.y || (e.y >= p.y && e.x < p.x))
-                            solver(x.data[w].ptr, data[cell].data[q].ptr);
+                T* ptr = x.data[w].ptr;
+                int ix = p.x/cell;
+                int iy = p.y/cell;
+                vec2x4 p4(p);
+                for(int i = 0; i < ns; i += 2) {
+                    hash = hasher(ix + ks[i], iy + ks[i + 1]);
+                    int slot = grid[hash%N];
+                    if(slot == -1) continue;
+                    Node& c = data[slot];
+                    if(!c.aabb.covers(p, h)) continue;
+                    int cs = c.count();
+                    int q = 0;
+                    if(c.aabb.lowerBound.y > p.y) {
+                        for(; q < cs; ++q)
+                            solver(ptr, c.data[q].ptr);
+                        continue;
+                    }
+                    for(; q + 4 <= cs; q += 4) {
+                        vec2x4 e = vec2x4::load(&c.data[q].p, sizeof(Pptr));
+                        int gt = ::less(p4.y, e.y);
+                        int ge = lessEq(p4.y, e.y);
+                        int lt = ::less(e.x, p4.x);
+                        int m = gt | (ge & lt);
+                        // Coincident points are ordered by _Less.
+                        int tie = (ge & ~gt) & (lessEq(e.x, p4.x) & ~lt);
+                        while(tie != 0) {
+                            int j = __builtin_ctz(tie);
+                            if(less(c.data[q + j].ptr, ptr))
+                                m |= 1 << j;
+                            tie &= tie - 1;
+                        }
+                        while(m != 0) {
+                            solver(ptr, c.data[q + __builtin_ctz(m)].ptr);
+                            m &= m - 1;
+                        }
+                    }
+                    for(; q < cs; ++q) {
+                        vec2& e = c.data[q].p;
+                        if(e.y > p.y || (e.y == p.y && (e.x < p.x || (e.x == p.x && less(c.data[q].ptr, ptr)))))
+                            solver(ptr, c.data[q].ptr);
                     }
                 }
             }
         }
     }
     
+    // Same contract as DynamicQuadTree::raycast. The segment is walked cell by cell (DDA)
+    // over the bounds of the inserted points and every cell within r of a step is visited once.
+    template <class _Callback>
+    float raycast(const vec2& origin, const vec2& dir, float maxT, _Callback callback, float r) {
+        if(null) return maxT;
+        
+        vec2 invDir = 1.0f / dir;
+        
+        AABB b = aabb;
+        b.extend(r);
+        
+        float t;
+        if(!::raycast(b, origin, invDir, maxT, t)) return maxT;
+        
+        ++rays;
+        
+        vec2 p = origin + t * dir;
+        int x = (int)floorf(p.x / cell);
+        int y = (int)floorf(p.y / cell);
+        
+        int sx = dir.x >= 0.0f ? 1 : -1;
+        int sy = dir.y >= 0.0f ? 1 : -1;
+        
+        float tx = dir.x != 0.0f ? ((x + (sx > 0)) * cell - origin.x) * invDir.x : FLT_MAX;
+        float ty = dir.y != 0.0f ? ((y + (sy > 0)) * cell - origin.y) * invDir.y : FLT_MAX;
+        float dx = dir.x != 0.0f ? cell * fabsf(invDir.x) : FLT_MAX;
+        float dy = dir.y != 0.0f ? cell * fabsf(invDir.y) : FLT_MAX;
+        
+        for(;;) {
+            // Cells are keyed by truncation, so map the floored step cell plus r back onto them.
+            int x0 = (int)((x * cell - r) / cell);
+            int x1 = (int)(((x + 1) * cell + r) / cell);
+            int y0 = (int)((y * cell - r) / cell);
+            int y1 = (int)(((y + 1) * cell + r) / cell);
+            
+            for(int i = y0; i <= y1; ++i)
+                for(int j = x0; j <= x1; ++j)
+                    raycast_cell(j, i, origin, invDir, r, maxT, callback);
+            
+            t = std::min(tx, ty);
+            if(t > maxT || t == FLT_MAX) break;
+            
+            vec2 q = origin + t * dir;
+            if(!b.covers(q, h)) break;
+            
+            if(tx < ty) {
+                tx += dx;
+                x += sx;
+            }else{
+                ty += dy;
+                y += sy;
+            }
+        }
+        
+        return maxT;
+    }
+    
+    template <class _Callback>
+    float raycast(const vec2& origin, const vec2& dir, float maxT, _Callback callback) {
+        return raycast(origin, dir, maxT, callback, h);
+    }
+    
     void insert_pointer(T* ptr, const vec2& p)
     {
-        size_t hash = hasher(p.x/h, p.y/h);
+        if(null) {
+            aabb.set(p);
+            null = false;
+        }else{
+            aabb.add(p);
+        }
+        
+        size_t hash = hasher(p.x/cell, p.y/cell);
         
         int& k = grid[hash%N];
+        canonical = false;
         
         if(k == -1) {
             Node n;
             k = (int)data.size();
+            n.stamp = rays;
+            n.slot = (int)(hash%N);
             n.aabb.set(p);
             n.add(ptr, p);
             data.push_back(n);
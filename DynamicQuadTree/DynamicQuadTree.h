@@ -9,54 +9,72 @@
 #ifndef DynamicQuadTree_h
 #define DynamicQuadTree_h
 
+#include <cmath>
 #include <cstring>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <memory>
 #include "AABB.h"
 
 typedef int32_t qt_int;
 
-template <class T>
+template <class T, class _Less = std::less<const T*>>
 class DynamicQuadTree
 {
     
+public:
+    
+    // Far-field summary of a node: total mass, centre of mass and, when requested,
+    // the traceless quadrupole sum(m * (3 d d^T - |d|^2 I)) about that centre.
+    struct Aggregate
+    {
+        float mass;
+        vec2 center;
+        float qxx;
+        float qxy;
+        float qyy;
+    };
+    
 protected:
     
-    struct Node
+    struct Pptr
     {
-        T** data;
-        
-        qt_int children[4];
-        
-        inline const qt_int& operator [] (int i) const { return children[i]; }
-        inline qt_int& operator [] (int i) { return children[i]; }
+        T* ptr;
+        vec2 p;
+    };
+    
+    // Particles of one leaf, kept apart from the nodes so interior nodes carry no payload.
+    // A single particle is stored in place of the buffer pointer.
+    struct Leaf
+    {
+        union
+        {
+            T** data;
+            T* one;
+        };
         
         qt_int count;
         qt_int capacity;
-                
-        Node() {}
-        
-        Node(const Node& x) = delete;
-        
-        inline Node& operator = (const Node& x) = delete;
         
         inline void init() {
-            capacity = 0;
+            capacity = 1;
             count = 0;
         }
         
         inline void free() {
-            if(capacity > 0)
+            if(capacity > 1)
                 ::free(data);
         }
         
-        inline void clear() {
-            count = 0;
-        }
-        
         inline void grow() {
-            if(capacity == 0) {
+            if(capacity == 1) {
+                T* p = one;
                 capacity = 4;
                 data = (T**)malloc(sizeof(T*) * capacity);
+                data[0] = p;
             }else{
                 capacity <<= 1;
                 data = (T**)realloc(data, sizeof(T*) * capacity);
@@ -67,34 +85,43 @@ protected:
         {
             if(count >= capacity)
                 grow();
-            data[count++] = ptr;
+            begin()[count++] = ptr;
         }
         
         inline T** begin()
         {
-            return data;
+            return capacity == 1 ? &one : data;
         }
         
         inline T** end()
         {
-            return data + count;
+            return begin() + count;
         }
+    };
+    
+    // Children present are flagged in `mask` (bit i = child i) and stored next to each other
+    // from `first`, in child order. Children of level 1 nodes are Leafs in `leaves`.
+    struct Node
+    {
+        qt_int first;
+        uint8_t mask;
         
-        inline const T** begin() const
+        // Set bits of a 4-bit mask, one nibble per value.
+        static inline qt_int bits(uint8_t m)
         {
-            return data;
+            return (qt_int)((0x4332322132212110ull >> (m * 4)) & 0xf);
         }
         
-        inline const T** end() const
-        {
-            return data + count;
+        inline void init() {
+            first = -1;
+            mask = 0;
         }
         
-        inline bool empty() const
+        inline qt_int child(uint8_t i) const
         {
-            return children[0] == -1 && children[1] == -1 && children[2] == -1 && children[3] == -1 && count == 0;
+            if(!(mask & (1 << i))) return -1;
+            return first + bits(mask & ((1 << i) - 1));
         }
-        
     };
     
     inline bool should_solve(qt_int a, qt_int b) const
@@ -103,95 +130,997 @@ protected:
         return true;
     }
     
+    // Points are kept out of the tree while covering them would take more than
+    // `slack` extra levels; they wait in `overflow` until a rebalance.
+    static const qt_int seed = 64;
+    static const qt_int slack = 2;
+    
     float h;
     float rootSize;
     
+    vec2 center;
+    
     Node* nodes;
     
     qt_int size;
     qt_int capacity;
     
+    Leaf* leaves;
+    
+    qt_int leafSize;
+    qt_int leafCapacity;
+    
+    // Sibling blocks released when a node gains a child, by block size - 1.
+    std::vector<qt_int> blocks[4];
+    std::vector<qt_int> leafBlocks[4];
+    
     qt_int root;
     
     qt_int level;
     
+    qt_int population;
+    
+    std::vector<Pptr> overflow;
+    
+    std::vector<Aggregate> aggregates;
+    std::vector<Aggregate> leafAggregates;
+    
+    inline Aggregate& aggregate_at(qt_int n, qt_int l)
+    {
+        return l == 0 ? leafAggregates[n] : aggregates[n];
+    }
+    
+    // The overflow split at medians into a binary tree of its own, so solve_far opens
+    // outliers by the same test as nodes. Buckets have left == -1.
+    struct Group
+    {
+        AABB box;
+        Aggregate a;
+        qt_int begin;
+        qt_int end;
+        qt_int left;
+        qt_int right;
+    };
+    
+    static const qt_int bucket = 1;
+    
+    std::vector<Group> groups;
+    
+    // Deterministic solve: every occupied h-cell (leaf or outlier) keyed by its integer
+    // coordinates, rows then columns, with its particles ordered by _Less in `members`.
+    // Cells are solved in bands of `band` rows, even bands first, so that no particle is
+    // written by two bands at once and the order never depends on the thread count.
+    struct Cell
+    {
+        int64_t key;
+        qt_int begin;
+        qt_int end;
+    };
+    
+    static const int band = 4;
+    static const int64_t row = (int64_t)1 << 32;
+    
+    _Less less;
+    
+    std::vector<Cell> canon;
+    std::vector<T*> members;
+    std::vector<std::pair<int64_t, qt_int>> occupied;
+    std::vector<std::pair<int64_t, T*>> outliers;
+    std::vector<std::pair<int, qt_int>> bands;
+    
+    bool canonical;
+    
+    // Whether the aggregates match the tree; any insert invalidates them.
+    bool aggregated;
+    
+    static inline int64_t cell_key(int x, int y)
+    {
+        return (int64_t)y * row + ((int64_t)x + 0x80000000ll);
+    }
+    
+    // Integer coordinate, in h-cells, of the root's lower edge along an axis centred at c.
+    inline int64_t origin(float c) const
+    {
+        return (int64_t)llroundf((c - rootSize * 0.5f) / h);
+    }
+    
+    // Descents walked in lock step by insert_batch and query_batch.
+    static const int group = 16;
+    
+    // Finds the leaves of m root-relative cells together, one level per round, prefetching
+    // each cursor's next node so the misses overlap. Missing leaves come back as -1.
+    void lookup_group(const int64_t* x, const int64_t* y, qt_int* i, int m) const
+    {
+        for(int g = 0; g < m; ++g)
+            i[g] = root;
+        
+        for(qt_int l = level - 1; l >= 0; --l) {
+            for(int g = 0; g < m; ++g) {
+                if(i[g] == -1) continue;
+                uint8_t c = ((x[g] >> l) & 1) | (((y[g] >> l) & 1) << 1);
+                qt_int k = nodes[i[g]].child(c);
+                i[g] = k;
+                if(k == -1) continue;
+                if(l > 0)
+                    __builtin_prefetch(nodes + k);
+                else
+                    __builtin_prefetch(leaves + k);
+            }
+        }
+    }
+    
+    // The lock-step descent of insert_batch; the tree already covers every position.
+    void insert_group(T* const* ptrs, const vec2* positions, int m) {
+        if(m == 0) return;
+        
+        int64_t side = (int64_t)1 << level;
+        int64_t ox = origin(center.x);
+        int64_t oy = origin(center.y);
+        
+        int64_t x[group];
+        int64_t y[group];
+        qt_int i[group];
+        
+        for(int g = 0; g < m; ++g) {
+            x[g] = std::min(std::max((int64_t)floorf(positions[g].x / h) - ox, (int64_t)0), side - 1);
+            y[g] = std::min(std::max((int64_t)floorf(positions[g].y / h) - oy, (int64_t)0), side - 1);
+            i[g] = root;
+        }
+        
+        for(qt_int l = level - 1; l >= 0; --l) {
+            for(int g = 0; g < m; ++g) {
+                uint8_t c = ((x[g] >> l) & 1) | (((y[g] >> l) & 1) << 1);
+                qt_int k = nodes[i[g]].child(c);
+                
+                if(k == -1) {
+                    qt_int first = nodes[i[g]].first;
+                    qt_int siblings = Node::bits(nodes[i[g]].mask);
+                    k = alloc_child(i[g], c, l);
+                    
+                    // The siblings moved; repoint the cursors that already stepped into them.
+                    qt_int b = nodes[i[g]].first;
+                    qt_int r = k - b;
+                    for(int e = 0; e < g; ++e) {
+                        qt_int d = i[e] - first;
+                        if(d >= 0 && d < siblings)
+                            i[e] = b + d + (d >= r);
+                    }
+                }
+                
+                i[g] = k;
+                if(l > 0)
+                    __builtin_prefetch(nodes + k);
+                else
+                    __builtin_prefetch(leaves + k);
+            }
+        }
+        
+        for(int g = 0; g < m; ++g) {
+            Leaf& f = leaf(i[g]);
+            if(f.capacity > 1)
+                __builtin_prefetch(f.data + f.count, 1);
+        }
+        
+        for(int g = 0; g < m; ++g)
+            leaf(i[g]).add(ptrs[g]);
+        
+        population += m;
+    }
+    
+    // Concurrent insertion: producers descend a shadow tree of dense four-child blocks in a
+    // chunked pool that never moves, installing missing children by CAS. Bottom slots hold
+    // cell ids, and each producer appends (cell, particle) to its own lane, so the real
+    // tree is not touched until end_concurrent merges the lanes into it. When the pool runs
+    // out, particles are spilled to their lane instead.
+    struct Concurrent
+    {
+        struct Block
+        {
+            std::atomic<qt_int> child[4];
+        };
+        
+        struct LaneData
+        {
+            std::vector<std::pair<qt_int, T*>> members;
+            std::vector<T*> spillPtrs;
+            std::vector<vec2> spill;
+            
+            // A block allocated for a CAS this lane lost, kept for its next install.
+            qt_int spare;
+        };
+        
+        // Padded to whole cache lines and kept in 64-byte aligned storage, so producers
+        // never share a line.
+        struct Lane : LaneData
+        {
+            char pad[64 - sizeof(LaneData) % 64];
+        };
+        
+        static const int chunkBits = 14;
+        static const int chunks = 4096;
+        
+        std::atomic<Block*> pool[chunks];
+        std::atomic<qt_int> next;
+        std::atomic<qt_int> cells;
+        std::atomic<bool> exhausted;
+        
+        void* laneStorage;
+        Lane* lanes;
+        int laneCapacity;
+        int threads;
+        
+        int64_t ox;
+        int64_t oy;
+        int64_t side;
+        qt_int level;
+        
+        bool active;
+        
+        std::vector<qt_int> offsets;
+        std::vector<T*> sorted;
+        
+        Concurrent() : next(0), cells(0), exhausted(false), laneStorage(nullptr), lanes(nullptr), laneCapacity(0), threads(0), active(false) {
+            for(int i = 0; i < chunks; ++i)
+                pool[i].store(nullptr, std::memory_order_relaxed);
+        }
+        
+        ~Concurrent() {
+            for(int i = 0; i < chunks; ++i)
+                delete[] pool[i].load(std::memory_order_relaxed);
+            
+            for(int i = 0; i < laneCapacity; ++i)
+                lanes[i].~Lane();
+            free(laneStorage);
+        }
+        
+        inline Block& block(qt_int i)
+        {
+            return pool[i >> chunkBits].load(std::memory_order_acquire)[i & ((1 << chunkBits) - 1)];
+        }
+        
+        // Returns -1 once the pool is exhausted.
+        qt_int alloc() {
+            const qt_int limit = chunks << chunkBits;
+            qt_int i = next.load(std::memory_order_relaxed) < limit ? next.fetch_add(1, std::memory_order_relaxed) : limit;
+            if(i >= limit) {
+                exhausted.store(true, std::memory_order_relaxed);
+                return -1;
+            }
+            
+            int c = i >> chunkBits;
+            
+            Block* chunk = pool[c].load(std::memory_order_acquire);
+            if(chunk == nullptr) {
+                Block* fresh = new Block[1 << chunkBits];
+                for(qt_int j = 0; j < (1 << chunkBits); ++j)
+                    for(int k = 0; k < 4; ++k)
+                        fresh[j].child[k].store(-1, std::memory_order_relaxed);
+                if(!pool[c].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel))
+                    delete[] fresh;
+            }
+            
+            return i;
+        }
+        
+        // Back to a single empty root block; used blocks are wiped, chunks are kept.
+        void reset(int count) {
+            qt_int used = std::min(next.load(std::memory_order_relaxed), (qt_int)(chunks << chunkBits));
+            for(qt_int i = 0; i < used; ++i)
+                for(int k = 0; k < 4; ++k)
+                    block(i).child[k].store(-1, std::memory_order_relaxed);
+            
+            next.store(0, std::memory_order_relaxed);
+            cells.store(0, std::memory_order_relaxed);
+            exhausted.store(false, std::memory_order_relaxed);
+            alloc();
+            
+            if(count > laneCapacity) {
+                for(int i = 0; i < laneCapacity; ++i)
+                    lanes[i].~Lane();
+                free(laneStorage);
+                
+                laneStorage = malloc(sizeof(Lane) * count + 63);
+                lanes = (Lane*)(((uintptr_t)laneStorage + 63) & ~(uintptr_t)63);
+                for(int i = 0; i < count; ++i)
+                    new (lanes + i) Lane();
+                laneCapacity = count;
+            }
+            
+            threads = count;
+            for(int i = 0; i < threads; ++i) {
+                Lane& lane = lanes[i];
+                lane.members.clear();
+                lane.spillPtrs.clear();
+                lane.spill.clear();
+                lane.spare = -1;
+            }
+        }
+    };
+    
+    std::unique_ptr<Concurrent> concurrent;
+    
+    // Whether any cell hangs below shadow block s at level l. Only blocks installed just
+    // before the pool ran out can be empty.
+    bool inhabited(qt_int s, qt_int l) {
+        Concurrent& cc = *concurrent;
+        
+        for(uint8_t c = 0; c < 4; ++c) {
+            qt_int v = cc.block(s).child[c].load(std::memory_order_relaxed);
+            if(v != -1 && (l == 1 || inhabited(v, l - 1)))
+                return true;
+        }
+        return false;
+    }
+    
+    // Walks shadow block s with the real node r at level l, creating the real children it
+    // lacks and handing the leaves their sorted members.
+    void merge_node(qt_int s, qt_int r, qt_int l) {
+        Concurrent& cc = *concurrent;
+        
+        for(uint8_t c = 0; c < 4; ++c) {
+            qt_int v = cc.block(s).child[c].load(std::memory_order_relaxed);
+            if(v == -1) continue;
+            if(l > 1 && cc.exhausted.load(std::memory_order_relaxed) && !inhabited(v, l - 1)) continue;
+            
+            qt_int k = nodes[r].child(c);
+            if(k == -1)
+                k = alloc_child(r, c, l - 1);
+            
+            if(l == 1) {
+                Leaf& f = leaf(k);
+                for(qt_int j = cc.offsets[v]; j < cc.offsets[v + 1]; ++j)
+                    f.add(cc.sorted[j]);
+            }else{
+                merge_node(v, k, l - 1);
+            }
+        }
+    }
+    
+    static inline int band_of(int64_t key)
+    {
+        int y = (int)(key >> 32);
+        return (y >= 0 ? y : y - band + 1) / band;
+    }
+    
+    template <class _Mass, class _Position>
+    void aggregate_node(qt_int n, qt_int l, _Mass& mass, _Position& position, bool quadrupole) {
+        Aggregate a;
+        a.mass = 0.0f;
+        a.center.set(0.0f, 0.0f);
+        a.qxx = a.qxy = a.qyy = 0.0f;
+        
+        if(l == 0) {
+            for(T*& p : leaf(n)) {
+                float m = mass(p);
+                a.mass += m;
+                a.center += m * position(p);
+            }
+            
+            if(a.mass > 0.0f)
+                a.center *= 1.0f / a.mass;
+            
+            if(quadrupole) {
+                for(T*& p : leaf(n)) {
+                    float m = mass(p);
+                    vec2 d = position(p) - a.center;
+                    float dd = d.magSq();
+                    a.qxx += m * (3.0f * d.x * d.x - dd);
+                    a.qxy += m * (3.0f * d.x * d.y);
+                    a.qyy += m * (3.0f * d.y * d.y - dd);
+                }
+            }
+            
+            leafAggregates[n] = a;
+            return;
+        }
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            aggregate_node(k, l - 1, mass, position, quadrupole);
+            const Aggregate& c = aggregate_at(k, l - 1);
+            a.mass += c.mass;
+            a.center += c.mass * c.center;
+        }
+        
+        if(a.mass > 0.0f)
+            a.center *= 1.0f / a.mass;
+        
+        if(quadrupole) {
+            for(uint8_t i = 0; i < 4; ++i) {
+                qt_int k = get(n, i);
+                if(k == -1) continue;
+                const Aggregate& c = aggregate_at(k, l - 1);
+                vec2 d = c.center - a.center;
+                float dd = d.magSq();
+                a.qxx += c.qxx + c.mass * (3.0f * d.x * d.x - dd);
+                a.qxy += c.qxy + c.mass * (3.0f * d.x * d.y);
+                a.qyy += c.qyy + c.mass * (3.0f * d.y * d.y - dd);
+            }
+        }
+        
+        aggregates[n] = a;
+    }
+    
+    // Sources for the bodies [tb, te) that lie in target: nodes whose cell is disjoint from
+    // target and whose size / distance < theta act as one pseudo-particle.
+    template <class _Near, class _Far>
+    void far_node(qt_int n, const vec2& c, float d, qt_int l, const AABB& target, T** tb, T** te, float theta2, _Near& nearSolver, _Far& farSolver) {
+        const Aggregate& a = aggregate_at(n, l);
+        
+        if(!touches(AABB(c - d, c + d), target) && 4.0f * d * d < theta2 * distSq(a.center, target)) {
+            for(T** t = tb; t != te; ++t)
+                farSolver(*t, a);
+            return;
+        }
+        
+        if(l == 0) {
+            for(T** t = tb; t != te; ++t)
+                for(T*& p : leaf(n))
+                    nearSolver(*t, p);
+            return;
+        }
+        
+        d *= 0.5f;
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            vec2 e(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            far_node(k, e, d, l - 1, target, tb, te, theta2, nearSolver, farSolver);
+        }
+    }
+    
+    template <class _Mass, class _Position>
+    qt_int aggregate_group(qt_int begin, qt_int end, _Mass& mass, _Position& position, bool quadrupole) {
+        qt_int g = (qt_int)groups.size();
+        groups.push_back(Group());
+        
+        Group o;
+        o.begin = begin;
+        o.end = end;
+        o.left = o.right = -1;
+        o.box.set(overflow[begin].p);
+        for(qt_int i = begin + 1; i < end; ++i)
+            o.box.add(overflow[i].p);
+        
+        Aggregate& a = o.a;
+        a.mass = 0.0f;
+        a.center.set(0.0f, 0.0f);
+        a.qxx = a.qxy = a.qyy = 0.0f;
+        
+        for(qt_int i = begin; i < end; ++i) {
+            float m = mass(overflow[i].ptr);
+            a.mass += m;
+            a.center += m * position(overflow[i].ptr);
+        }
+        
+        if(a.mass > 0.0f)
+            a.center *= 1.0f / a.mass;
+        
+        if(quadrupole) {
+            for(qt_int i = begin; i < end; ++i) {
+                float m = mass(overflow[i].ptr);
+                vec2 d = position(overflow[i].ptr) - a.center;
+                float dd = d.magSq();
+                a.qxx += m * (3.0f * d.x * d.x - dd);
+                a.qxy += m * (3.0f * d.x * d.y);
+                a.qyy += m * (3.0f * d.y * d.y - dd);
+            }
+        }
+        
+        if(end - begin > bucket) {
+            vec2 s = o.box.upperBound - o.box.lowerBound;
+            qt_int mid = begin + (end - begin) / 2;
+            if(s.x >= s.y)
+                std::nth_element(overflow.begin() + begin, overflow.begin() + mid, overflow.begin() + end, [] (const Pptr& a, const Pptr& b) { return a.p.x < b.p.x; });
+            else
+                std::nth_element(overflow.begin() + begin, overflow.begin() + mid, overflow.begin() + end, [] (const Pptr& a, const Pptr& b) { return a.p.y < b.p.y; });
+            
+            o.left = aggregate_group(begin, mid, mass, position, quadrupole);
+            o.right = aggregate_group(mid, end, mass, position, quadrupole);
+        }
+        
+        groups[g] = o;
+        return g;
+    }
+    
+    template <class _Near, class _Far>
+    void far_group(qt_int g, const AABB& target, T** tb, T** te, float theta2, _Near& nearSolver, _Far& farSolver) {
+        const Group& o = groups[g];
+        vec2 s = o.box.upperBound - o.box.lowerBound;
+        float d = std::max(s.x, s.y);
+        
+        if(!touches(o.box, target) && d * d < theta2 * distSq(o.a.center, target)) {
+            for(T** t = tb; t != te; ++t)
+                farSolver(*t, o.a);
+            return;
+        }
+        
+        if(o.left == -1) {
+            for(T** t = tb; t != te; ++t)
+                for(qt_int i = o.begin; i < o.end; ++i)
+                    nearSolver(*t, overflow[i].ptr);
+            return;
+        }
+        
+        far_group(o.left, target, tb, te, theta2, nearSolver, farSolver);
+        far_group(o.right, target, tb, te, theta2, nearSolver, farSolver);
+    }
+    
+    template <class _Near, class _Far>
+    void far_target(T** tb, T** te, const AABB& target, float theta2, _Near& nearSolver, _Far& farSolver) {
+        if(population > 0)
+            far_node(root, center, rootSize * 0.5f, level, target, tb, te, theta2, nearSolver, farSolver);
+        
+        if(!groups.empty())
+            far_group(0, target, tb, te, theta2, nearSolver, farSolver);
+    }
+    
+    qt_int count_node(qt_int n, qt_int l) const
+    {
+        if(l == 0) return leaf(n).count;
+        
+        qt_int c = 0;
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k != -1) c += count_node(k, l - 1);
+        }
+        return c;
+    }
+    
+    template <class _Callback>
+    void cells_node(qt_int n, const vec2& c, float d, qt_int l, qt_int depth, _Callback& callback) const
+    {
+        if(depth == 0) {
+            callback(AABB(c - d, c + d), count_node(n, l));
+            return;
+        }
+        
+        d *= 0.5f;
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            vec2 e(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            cells_node(k, e, d, l - 1, depth - 1, callback);
+        }
+    }
+    
+    template <class _Near, class _Far>
+    void far_leaves(qt_int n, const vec2& c, float d, qt_int l, float theta2, _Near& nearSolver, _Far& farSolver) {
+        if(l == 0) {
+            far_target(leaf(n).begin(), leaf(n).end(), AABB(c - d, c + d), theta2, nearSolver, farSolver);
+            return;
+        }
+        
+        d *= 0.5f;
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            vec2 e(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            far_leaves(k, e, d, l - 1, theta2, nearSolver, farSolver);
+        }
+    }
+    
+    void leaves_node(qt_int n, int x, int y, qt_int l) {
+        if(l == 0) {
+            if(leaf(n).count > 0)
+                occupied.push_back(std::make_pair(cell_key(x, y), n));
+            return;
+        }
+        
+        int s = 1 << (l - 1);
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            leaves_node(k, x + ((i & 1) ? s : 0), y + ((i & 2) ? s : 0), l - 1);
+        }
+    }
+    
+    void canonicalize() {
+        canon.clear();
+        members.clear();
+        occupied.clear();
+        outliers.clear();
+        
+        if(population > 0) {
+            leaves_node(root, (int)origin(center.x), (int)origin(center.y), level);
+            std::sort(occupied.begin(), occupied.end());
+        }
+        
+        for(Pptr& e : overflow)
+            outliers.push_back(std::make_pair(cell_key((int)floorf(e.p.x / h), (int)floorf(e.p.y / h)), e.ptr));
+        
+        std::sort(outliers.begin(), outliers.end(), [] (const std::pair<int64_t, T*>& a, const std::pair<int64_t, T*>& b) { return a.first < b.first; });
+        
+        size_t i = 0;
+        size_t j = 0;
+        
+        while(i < occupied.size() || j < outliers.size()) {
+            Cell c;
+            if(j == outliers.size() || (i < occupied.size() && occupied[i].first <= outliers[j].first)) {
+                c.key = occupied[i].first;
+            }else{
+                c.key = outliers[j].first;
+            }
+            
+            c.begin = (qt_int)members.size();
+            
+            if(i < occupied.size() && occupied[i].first == c.key) {
+                for(T*& p : leaf(occupied[i].second))
+                    members.push_back(p);
+                ++i;
+            }
+            
+            for(; j < outliers.size() && outliers[j].first == c.key; ++j)
+                members.push_back(outliers[j].second);
+            
+            c.end = (qt_int)members.size();
+            std::sort(members.begin() + c.begin, members.end(), less);
+            canon.push_back(c);
+        }
+        
+        canonical = true;
+    }
+    
+    template <class _Solver>
+    inline void solve_members(const Cell& a, const Cell& b, _Solver& solver) {
+        T** m = members.data();
+        for(qt_int s = a.begin; s < a.end; ++s)
+            for(qt_int t = b.begin; t < b.end; ++t)
+                solver(m[s], m[t]);
+    }
+    
+    // Each cell against itself, its right neighbour and the three cells above it.
+    template <class _Solver>
+    void solve_band(qt_int b, qt_int e, _Solver& solver) {
+        T** m = members.data();
+        qt_int cs = (qt_int)canon.size();
+        qt_int u = b;
+        
+        for(qt_int i = b; i < e; ++i) {
+            const Cell& c = canon[i];
+            
+            for(qt_int s = c.begin; s < c.end; ++s)
+                for(qt_int t = s; t < c.end; ++t)
+                    solver(m[s], m[t]);
+            
+            if(i + 1 < cs && canon[i + 1].key == c.key + 1)
+                solve_members(c, canon[i + 1], solver);
+            
+            int64_t k = c.key + row - 1;
+            while(u < cs && canon[u].key < k) ++u;
+            for(qt_int v = u; v < cs && canon[v].key <= k + 2; ++v)
+                solve_members(c, canon[v], solver);
+        }
+    }
+    
+    template <class _Solver>
+    void solve_canonical(_Solver& solver, int threads) {
+        if(!canonical)
+            canonicalize();
+        
+        bands.clear();
+        for(qt_int i = 0; i < (qt_int)canon.size(); ++i) {
+            int b = band_of(canon[i].key);
+            if(bands.empty() || bands.back().first != b)
+                bands.push_back(std::make_pair(b, i));
+        }
+        
+        qt_int bs = (qt_int)bands.size();
+        qt_int cs = (qt_int)canon.size();
+        
+        for(int parity = 0; parity < 2; ++parity) {
+            std::atomic<qt_int> next(0);
+            
+            auto work = [&] () {
+                for(qt_int i = next++; i < bs; i = next++) {
+                    if((bands[i].first & 1) != parity) continue;
+                    solve_band(bands[i].second, i + 1 < bs ? bands[i + 1].second : cs, solver);
+                }
+            };
+            
+            std::vector<std::future<void>> workers;
+            for(int t = 1; t < threads; ++t)
+                workers.push_back(std::async(std::launch::async, work));
+            
+            work();
+            
+            for(auto& w : workers)
+                w.get();
+        }
+    }
+    
 public:
     
+    // When set, solve visits pairs in an order fixed by the positions and _Less alone, so
+    // accumulations are bitwise reproducible across insertion orders and thread counts.
+    // The default _Less compares addresses, so runs only repeat when the particles live in
+    // one array in a fixed order; otherwise pass a _Less on a stable id.
+    bool deterministic;
     
-    DynamicQuadTree(float h) : h(h) , capacity(256), root(0), size(1), rootSize(h), level(0) {
+    DynamicQuadTree(float h) : h(h), rootSize(h), center(0.0f), size(1), capacity(256), leafSize(0), leafCapacity(256), root(0), level(0), population(0), canonical(false), aggregated(false), deterministic(false) {
         nodes = (Node*)malloc(sizeof(Node) * capacity);
-        for (qt_int i = 0; i < capacity; ++i) {
-            nodes[i].init();
-            nodes[i].children[0] = -1;
-            nodes[i].children[1] = -1;
-            nodes[i].children[2] = -1;
-            nodes[i].children[3] = -1;
-        }
+        nodes[root].init();
+        
+        leaves = (Leaf*)malloc(sizeof(Leaf) * leafCapacity);
+        for (qt_int i = 0; i < leafCapacity; ++i)
+            leaves[i].init();
+        
         expand_once();
     }
     
     ~DynamicQuadTree() {
-        for (qt_int i = 0; i < capacity; ++i)
-            nodes[i].free();
+        for (qt_int i = 0; i < leafCapacity; ++i)
+            leaves[i].free();
         
+        free(leaves);
         free(nodes);
     }
     
-    
-    qt_int alloc_node() {
-        if(size >= capacity) {
-            qt_int cap = capacity << 1;
-            nodes = (Node*)realloc(nodes, sizeof(Node) * cap);
-            for (qt_int i = capacity; i < cap; ++i) {
-                nodes[i].init();
-                nodes[i].children[0] = -1;
-                nodes[i].children[1] = -1;
-                nodes[i].children[2] = -1;
-                nodes[i].children[3] = -1;
-            }
-            capacity = cap;
+    // Returns the first of k adjacent free nodes.
+    qt_int alloc_block(qt_int k) {
+        std::vector<qt_int>& b = blocks[k - 1];
+        if(!b.empty()) {
+            qt_int n = b.back();
+            b.pop_back();
+            return n;
         }
-        return size++;
+        
+        if(size + k > capacity) {
+            while(size + k > capacity) capacity <<= 1;
+            nodes = (Node*)realloc(nodes, sizeof(Node) * capacity);
+        }
+        
+        qt_int n = size;
+        size += k;
+        return n;
     }
     
+    // Same for leaves. Freed leaves keep their buffers for reuse.
+    qt_int alloc_leaves(qt_int k) {
+        std::vector<qt_int>& b = leafBlocks[k - 1];
+        if(!b.empty()) {
+            qt_int n = b.back();
+            b.pop_back();
+            return n;
+        }
+        
+        if(leafSize + k > leafCapacity) {
+            qt_int cap = leafCapacity;
+            while(leafSize + k > cap) cap <<= 1;
+            leaves = (Leaf*)realloc(leaves, sizeof(Leaf) * cap);
+            for (qt_int i = leafCapacity; i < cap; ++i)
+                leaves[i].init();
+            leafCapacity = cap;
+        }
+        
+        qt_int n = leafSize;
+        leafSize += k;
+        return n;
+    }
     
+    void clear() {
+        size = 1;
+        nodes[root].init();
+        for(std::vector<qt_int>& b : blocks)
+            b.clear();
+        for(std::vector<qt_int>& b : leafBlocks)
+            b.clear();
+        leafSize = 0;
+        rootSize = h;
+        center.set(0.0f, 0.0f);
+        level = 0;
+        population = 0;
+        canonical = false;
+        aggregated = false;
+        overflow.clear();
+        groups.clear();
+        expand_once();
+    }
     
+    // Pushes every child of the root one level down, towards the centre.
     void expand_once() {
-        qt_int n[4] = {-1, -1, -1, -1};
+        uint8_t mask = nodes[root].mask;
         
-        for(qt_int i = 0; i < 4; ++i) {
+        if(mask != 0) {
+            qt_int k = Node::bits(mask);
+            qt_int b = alloc_block(k);
+            qt_int first = nodes[root].first;
             
-            if(get(root, i) != -1) {
-                n[i] = alloc_node();
-                nodes[n[i]][3 - i] = get(root, i);
+            // Each old child stays where it is as a one-child block of its new parent.
+            for(qt_int i = 0, j = 0; i < 4; ++i) {
+                if(!(mask & (1 << i))) continue;
+                nodes[b + j].first = first + j;
+                nodes[b + j].mask = 1 << (3 - i);
+                ++j;
             }
             
+            nodes[root].first = b;
         }
         
-        for(qt_int i = 0; i < 4; ++i) {
-            nodes[root][i] = n[i];
+        rootSize *= 2.0f;
+        ++level;
+    }
+    
+    // Doubles the root towards p; the old root becomes one quadrant of the new one.
+    void expand_toward(const vec2& p) {
+        float d = rootSize * 0.5f;
+        uint8_t c = 0;
+        
+        if(p.x >= center.x) {
+            center.x += d;
+        }else{
+            center.x -= d;
+            c |= 1;
+        }
+        
+        if(p.y >= center.y) {
+            center.y += d;
+        }else{
+            center.y -= d;
+            c |= 2;
+        }
+        
+        if(nodes[root].mask != 0) {
+            qt_int n = alloc_block(1);
+            nodes[n] = nodes[root];
+            nodes[root].first = n;
+            nodes[root].mask = 1 << c;
         }
         
         rootSize *= 2.0f;
         ++level;
     }
     
+    inline bool covers(const vec2& p) const
+    {
+        float d = rootSize * 0.5f;
+        return p.x >= center.x - d && p.y >= center.y - d && p.x < center.x + d && p.y < center.y + d;
+    }
+    
+    inline AABB bounds() const
+    {
+        float d = rootSize * 0.5f;
+        return AABB(center - d, center + d);
+    }
+    
     void grow_to(const vec2& p)
     {
-        float pSize = std::max(abs(p.x), abs(p.y)) * 2.0f;
-        while(rootSize < pSize)
-            expand_once();
+        while(!covers(p))
+            expand_toward(p);
     }
     
-    inline qt_int& get(qt_int i, uint8_t n) const
+    // Whether p is within `slack` doublings of the current root.
+    bool reaches(const vec2& p) const
     {
-        return nodes[i][n];
+        float d = rootSize * 0.5f;
+        vec2 c = center;
+        for(qt_int i = 0; i <= slack; ++i) {
+            if(p.x >= c.x - d && p.y >= c.y - d && p.x < c.x + d && p.y < c.y + d)
+                return true;
+            c.x += p.x >= c.x ? d : -d;
+            c.y += p.y >= c.y ? d : -d;
+            d *= 2.0f;
+        }
+        return false;
+    }
+    
+    // Moves the bulk of the overflow into the tree. An empty tree is recentred on the
+    // median of the waiting points; points farther than twice the 7/8 quantile of their
+    // distance to the centre are left in the overflow.
+    void rebalance() {
+        std::vector<Pptr> pts;
+        pts.swap(overflow);
+        canonical = false;
+        aggregated = false;
+        
+        if(pts.empty()) return;
+        
+        std::vector<float> r(pts.size());
+        size_t m = pts.size() / 2;
+        
+        if(population == 0) {
+            for(size_t i = 0; i < pts.size(); ++i) r[i] = pts[i].p.x;
+            std::nth_element(r.begin(), r.begin() + m, r.end());
+            center.x = floorf(r[m] / h) * h;
+            
+            for(size_t i = 0; i < pts.size(); ++i) r[i] = pts[i].p.y;
+            std::nth_element(r.begin(), r.begin() + m, r.end());
+            center.y = floorf(r[m] / h) * h;
+        }
+        
+        for(size_t i = 0; i < pts.size(); ++i) {
+            vec2 d = pts[i].p - center;
+            r[i] = std::max(fabsf(d.x), fabsf(d.y));
+        }
+        
+        size_t q = (pts.size() * 7) / 8;
+        std::nth_element(r.begin(), r.begin() + q, r.end());
+        float reach = r[q] * 2.0f;
+        
+        for(Pptr& e : pts) {
+            vec2 d = e.p - center;
+            if(std::max(fabsf(d.x), fabsf(d.y)) <= reach) {
+                grow_to(e.p);
+                insert_tree(e.ptr, e.p);
+            }else{
+                overflow.push_back(e);
+            }
+        }
+    }
+    
+    inline qt_int depth() const
+    {
+        return level;
+    }
+    
+    inline qt_int count() const
+    {
+        return population + (qt_int)overflow.size();
+    }
+
+    // Occupied leaves, without walking the tree.
+    inline qt_int leaf_count() const
+    {
+        qt_int n = leafSize;
+        for(qt_int k = 1; k <= 4; ++k)
+            n -= k * (qt_int)leafBlocks[k - 1].size();
+        return n;
+    }
+
+    // Calls callback(cell, count) for every occupied node `depth` levels below the root, in
+    // Morton order (child index = x bit | y bit << 1), with the number of particles below it.
+    // Outliers in the overflow are not part of any cell.
+    template <class _Callback>
+    void cells(qt_int depth, _Callback callback) const
+    {
+        if(population > 0)
+            cells_node(root, center, rootSize * 0.5f, level, std::min(depth, level), callback);
+    }
+    
+    // Calls callback(T*, position) for every outlier in the overflow.
+    template <class _Callback>
+    void overflowed(_Callback callback) const
+    {
+        for(const Pptr& e : overflow)
+            callback(e.ptr, e.p);
+    }
+    
+    inline qt_int get(qt_int i, uint8_t n) const
+    {
+        return nodes[i].child(n);
     }
     
     inline qt_int at(qt_int i, uint8_t n) const
     {
         if(i == -1) return -1;
-        return nodes[i][n];
+        return nodes[i].child(n);
+    }
+    
+    // All four children of i, -1 where absent or when i is -1.
+    inline void children(qt_int i, qt_int* k) const
+    {
+        if(i == -1) {
+            k[0] = k[1] = k[2] = k[3] = -1;
+            return;
+        }
+        
+        const Node& e = nodes[i];
+        qt_int c = e.first;
+        for(uint8_t j = 0; j < 4; ++j) {
+            qt_int b = (e.mask >> j) & 1;
+            k[j] = b ? c : -1;
+            c += b;
+        }
+    }
+    
+    inline Leaf& leaf(qt_int i) const
+    {
+        return leaves[i];
     }
     
     inline qt_int at(qt_int i, uint8_t n, uint8_t k) const
@@ -201,18 +1130,19 @@ public:
     
     template <class _Solver>
     void solve_single(qt_int n, _Solver& solver) {
-        qt_int& ct = nodes[n].count;
-        for(qt_int i = 0; i < ct; ++i) {
-            for(qt_int j = i; j < ct; ++j) {
-                solver(nodes[n].data[i], nodes[n].data[j]);
+        Leaf& e = leaf(n);
+        T** data = e.begin();
+        for(qt_int i = 0; i < e.count; ++i) {
+            for(qt_int j = i; j < e.count; ++j) {
+                solver(data[i], data[j]);
             }
         }
     }
     
     template <class _Solver>
     void solve_cells(qt_int n0, qt_int n1, _Solver& solver) {
-        for(T*& p0 : nodes[n0])
-            for(T*& p1 : nodes[n1])
+        for(T*& p0 : leaf(n0))
+            for(T*& p1 : leaf(n1))
                 solver(p0, p1);
     }
     
@@ -281,15 +1211,19 @@ public:
             return;
         }
         
-        if(l >= 2) {
-            solve_node_c(at(n0, 3), at(n1, 2), at(n2, 1), at(n3, 0), l - 1, solver);
-        }
+        qt_int c0[4], c1[4], c2[4], c3[4];
+        children(n0, c0);
+        children(n1, c1);
+        children(n2, c2);
+        children(n3, c3);
+        
+        solve_node_c(c0[3], c1[2], c2[1], c3[0], l - 1, solver);
         
         if(n0 != -1 && n2 != -1 && should_solve(n0, n2))
-            solve_node_v(get(n0, 2), get(n0, 3), get(n2, 0), get(n2, 1), l - 1, solver);
+            solve_node_v(c0[2], c0[3], c2[0], c2[1], l - 1, solver);
         
         if(n1 != -1 && n3 != -1 && should_solve(n1, n3))
-            solve_node_v(get(n1, 2), get(n1, 3), get(n3, 0), get(n3, 1), l - 1, solver);
+            solve_node_v(c1[2], c1[3], c3[0], c3[1], l - 1, solver);
     }
     
     template <class _Solver>
@@ -305,15 +1239,19 @@ public:
             return;
         }
         
-        if(l >= 2) {
-            solve_node_c(at(n0, 3), at(n1, 2), at(n2, 1), at(n3, 0), l - 1, solver);
-        }
+        qt_int c0[4], c1[4], c2[4], c3[4];
+        children(n0, c0);
+        children(n1, c1);
+        children(n2, c2);
+        children(n3, c3);
+        
+        solve_node_c(c0[3], c1[2], c2[1], c3[0], l - 1, solver);
         
         if(n0 != -1 && n1 != -1 && should_solve(n0, n1))
-            solve_node_h(get(n0, 1), get(n1, 0), get(n0, 3), get(n1, 2), l - 1, solver);
+            solve_node_h(c0[1], c1[0], c0[3], c1[2], l - 1, solver);
         
         if(n2 != -1 && n3 != -1 && should_solve(n2, n3))
-            solve_node_h(get(n2, 1), get(n3, 0), get(n2, 3), get(n3, 2), l - 1, solver);
+            solve_node_h(c2[1], c3[0], c2[3], c3[2], l - 1, solver);
     }
     
     template <class _Solver>
@@ -344,91 +1282,513 @@ public:
             return;
         }
         
+        qt_int c0[4], c1[4], c2[4], c3[4];
+        children(n0, c0);
+        children(n1, c1);
+        children(n2, c2);
+        children(n3, c3);
+        
         if(n0 != -1) {
-            solve_node(nodes[n0][0], nodes[n0][1], nodes[n0][2], nodes[n0][3], l - 1, solver);
+            solve_node(c0[0], c0[1], c0[2], c0[3], l - 1, solver);
             
             if(n1 != -1 && should_solve(n0, n1))
-                solve_node_h(nodes[n0][1], nodes[n1][0], nodes[n0][3], nodes[n1][2], l - 1, solver);
+                solve_node_h(c0[1], c1[0], c0[3], c1[2], l - 1, solver);
             
             if(n2 != -1 && should_solve(n0, n2))
-                solve_node_v(nodes[n0][2], nodes[n0][3], nodes[n2][0], nodes[n2][1], l - 1, solver);
+                solve_node_v(c0[2], c0[3], c2[0], c2[1], l - 1, solver);
         }
         
         if(n1 != -1)
-            solve_node(nodes[n1][0], nodes[n1][1], nodes[n1][2], nodes[n1][3], l - 1, solver);
+            solve_node(c1[0], c1[1], c1[2], c1[3], l - 1, solver);
         
         if(n2 != -1)
-            solve_node(nodes[n2][0], nodes[n2][1], nodes[n2][2], nodes[n2][3], l - 1, solver);
+            solve_node(c2[0], c2[1], c2[2], c2[3], l - 1, solver);
         
         if(n3 != -1) {
-            solve_node(nodes[n3][0], nodes[n3][1], nodes[n3][2], nodes[n3][3], l - 1, solver);
+            solve_node(c3[0], c3[1], c3[2], c3[3], l - 1, solver);
             
             if(n1 != -1 && should_solve(n1, n3))
-                solve_node_v(nodes[n1][2], nodes[n1][3], nodes[n3][0], nodes[n3][1], l - 1, solver);
+                solve_node_v(c1[2], c1[3], c3[0], c3[1], l - 1, solver);
             
             if(n2 != -1 && should_solve(n2, n3))
-                solve_node_h(nodes[n2][1], nodes[n3][0], nodes[n2][3], nodes[n3][2], l - 1, solver);
+                solve_node_h(c2[1], c3[0], c2[3], c3[2], l - 1, solver);
         }
         
         if((n0 != -1 && n3 != -1 && should_solve(n0, n3)) || (n1 != -1 && n2 != -1 && should_solve(n1, n2)))
-            solve_node_c(at(n0, 3), at(n1, 2), at(n2, 1), at(n3, 0), l - 1, solver);
+            solve_node_c(c0[3], c1[2], c2[1], c3[0], l - 1, solver);
+    }
+    
+    template <class _Callback>
+    void query_node(qt_int n, const vec2& c, float d, qt_int l, const AABB& aabb, _Callback& callback) {
+        if(l == 0) {
+            for(T*& p : leaf(n))
+                callback(p);
+            return;
+        }
+        
+        d *= 0.5f;
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int k = get(n, i);
+            if(k == -1) continue;
+            
+            vec2 e(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            if(touches(AABB(e - d, e + d), aabb))
+                query_node(k, e, d, l - 1, aabb, callback);
+        }
+    }
+    
+    // Outliers against each other (sweep along x) and against the cells around them.
+    template <class _Solver>
+    void solve_overflow(_Solver& solver) {
+        std::sort(overflow.begin(), overflow.end(), [] (const Pptr& a, const Pptr& b) { return a.p.x < b.p.x; });
+        
+        // Each outlier meets itself once, as tree particles do in solve_single.
+        size_t os = overflow.size();
+        for(size_t i = 0; i < os; ++i) {
+            solver(overflow[i].ptr, overflow[i].ptr);
+            for(size_t j = i + 1; j < os && overflow[j].p.x - overflow[i].p.x <= h; ++j) {
+                if(fabsf(overflow[j].p.y - overflow[i].p.y) <= h)
+                    solver(overflow[i].ptr, overflow[j].ptr);
+            }
+        }
+        
+        if(population == 0) return;
+        
+        AABB b = bounds();
+        
+        for(Pptr& e : overflow) {
+            AABB aabb(e.p);
+            aabb.extend(h);
+            if(!touches(b, aabb)) continue;
+            
+            T* ptr = e.ptr;
+            auto pair = [ptr, &solver] (T* q) { solver(ptr, q); };
+            query_node(root, center, rootSize * 0.5f, level, aabb, pair);
+        }
     }
     
+    template <class _Callback>
+    void raycast_node(qt_int n, const vec2& c, float d, qt_int l, const vec2& origin, const vec2& invDir, float r, float& maxT, _Callback& callback) {
+        if(l == 0) {
+            for(T*& p : leaf(n))
+                maxT = callback(p, maxT);
+            return;
+        }
+        
+        d *= 0.5f;
+        
+        qt_int k[4];
+        float t[4];
+        int hits = 0;
+        
+        for(uint8_t i = 0; i < 4; ++i) {
+            qt_int e = get(n, i);
+            if(e == -1) continue;
+            
+            vec2 m(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            AABB box(m - (d + r), m + (d + r));
+            
+            float s;
+            if(!::raycast(box, origin, invDir, maxT, s)) continue;
+            
+            int j = hits++;
+            for(; j > 0 && t[j - 1] > s; --j) {
+                k[j] = k[j - 1];
+                t[j] = t[j - 1];
+            }
+            k[j] = i;
+            t[j] = s;
+        }
+        
+        for(int j = 0; j < hits; ++j) {
+            if(t[j] > maxT) break;
+            uint8_t i = k[j];
+            vec2 m(c.x + ((i & 1) ? d : -d), c.y + ((i & 2) ? d : -d));
+            raycast_node(get(n, i), m, d, l - 1, origin, invDir, r, maxT, callback);
+        }
+    }
+    
+    // threads > 1 splits the deterministic solve across workers; the solver must then be safe
+    // to call concurrently for disjoint pairs.
     template <class _Solver>
-    void solve(_Solver solver) {
-        solve_node(at(root, 0), at(root, 1), at(root, 2), at(root, 3), level, solver);
+    void solve(_Solver solver, int threads = 1) {
+        if(deterministic) {
+            solve_canonical(solver, threads);
+            return;
+        }
+        
+        if(population > 0)
+            solve_node(at(root, 0), at(root, 1), at(root, 2), at(root, 3), level, solver);
+        
+        if(!overflow.empty())
+            solve_overflow(solver);
     }
     
+    // Walks the cells within r of the segment origin + t * dir, t in [0, maxT], front to back.
+    // callback(T*, maxT) is called for every particle in them and returns the new maxT;
+    // cells starting beyond it are skipped. Returns the final maxT.
+    template <class _Callback>
+    float raycast(const vec2& origin, const vec2& dir, float maxT, _Callback callback, float r) {
+        vec2 invDir = 1.0f / dir;
+        float t;
+        
+        for(Pptr& e : overflow) {
+            AABB box(e.p);
+            box.extend(r);
+            if(::raycast(box, origin, invDir, maxT, t))
+                maxT = callback(e.ptr, maxT);
+        }
+        
+        if(population == 0) return maxT;
+        
+        AABB b = bounds();
+        b.extend(r);
+        
+        if(::raycast(b, origin, invDir, maxT, t))
+            raycast_node(root, center, rootSize * 0.5f, level, origin, invDir, r, maxT, callback);
+        
+        return maxT;
+    }
     
-    inline void alloc_child(qt_int i, qt_int c) {
-        if(nodes[i][c] == -1)
-            nodes[i][c] = alloc_node();
+    template <class _Callback>
+    float raycast(const vec2& origin, const vec2& dir, float maxT, _Callback callback) {
+        return raycast(origin, dir, maxT, callback, h);
     }
     
+    // Computes the per-node aggregates bottom-up; call it after the last insert and before
+    // solve_far. mass(T*) and position(T*) describe the bodies.
+    template <class _Mass, class _Position>
+    void aggregate(_Mass mass, _Position position, bool quadrupole = false) {
+        aggregates.resize(size);
+        leafAggregates.resize(leafSize);
+        if(population > 0)
+            aggregate_node(root, level, mass, position, quadrupole);
+        
+        groups.clear();
+        if(!overflow.empty())
+            aggregate_group(0, (qt_int)overflow.size(), mass, position, quadrupole);
+        
+        aggregated = true;
+    }
     
-    void insert_pointer(T* ptr, const vec2& p) {
-        grow_to(p);
+    // Barnes-Hut traversal. Every body receives nearSolver(body, other) for each body it is not
+    // well separated from, itself included, and farSolver(body, aggregate) for each node that
+    // is. Unlike solve, interactions are one-sided: each ordered pair is visited once.
+    template <class _Near, class _Far>
+    void solve_far(float theta, _Near nearSolver, _Far farSolver) {
+        if(!aggregated) {
+            printf("DynamicQuadTree: solve_far needs aggregate() after the last insert\n");
+            return;
+        }
+        
+        float theta2 = theta * theta;
+        
+        if(population > 0)
+            far_leaves(root, center, rootSize * 0.5f, level, theta2, nearSolver, farSolver);
+        
+        for(Pptr& e : overflow)
+            far_target(&e.ptr, &e.ptr + 1, AABB(e.p), theta2, nearSolver, farSolver);
+    }
+    
+    // Calls callback(T*) for every particle in the cells touching aabb and every
+    // outlier inside it.
+    template <class _Callback>
+    void query(const AABB& aabb, _Callback callback) {
+        if(population > 0 && touches(bounds(), aabb))
+            query_node(root, center, rootSize * 0.5f, level, aabb, callback);
+        
+        for(Pptr& e : overflow)
+            if(aabb.covers(e.p))
+                callback(e.ptr);
+    }
+    
+    // Calls callback(i, T*) for every particle in the h-cells overlapping the box of half
+    // size r around points[i], then for every outlier inside that box. The cell lookups
+    // run `group` at a time in lock step, so one query's misses overlap the next ones'.
+    template <class _Callback>
+    void query_batch(const vec2* points, size_t n, float r, _Callback callback) {
+        if(population > 0) {
+            int64_t side = (int64_t)1 << level;
+            int64_t ox = origin(center.x);
+            int64_t oy = origin(center.y);
+            
+            int64_t gx[group];
+            int64_t gy[group];
+            qt_int gi[group];
+            size_t gq[group];
+            int m = 0;
+            
+            auto flush = [&] () {
+                lookup_group(gx, gy, gi, m);
+                for(int g = 0; g < m; ++g) {
+                    if(gi[g] == -1) continue;
+                    for(T*& p : leaf(gi[g]))
+                        callback(gq[g], p);
+                }
+                m = 0;
+            };
+            
+            for(size_t q = 0; q < n; ++q) {
+                const vec2& p = points[q];
+                int64_t x0 = std::max((int64_t)floorf((p.x - r) / h) - ox, (int64_t)0);
+                int64_t x1 = std::min((int64_t)floorf((p.x + r) / h) - ox, side - 1);
+                int64_t y0 = std::max((int64_t)floorf((p.y - r) / h) - oy, (int64_t)0);
+                int64_t y1 = std::min((int64_t)floorf((p.y + r) / h) - oy, side - 1);
+                
+                for(int64_t y = y0; y <= y1; ++y) {
+                    for(int64_t x = x0; x <= x1; ++x) {
+                        gx[m] = x;
+                        gy[m] = y;
+                        gq[m] = q;
+                        if(++m == group)
+                            flush();
+                    }
+                }
+            }
+            
+            flush();
+        }
+        
+        if(overflow.empty()) return;
+        
+        for(size_t q = 0; q < n; ++q) {
+            AABB aabb(points[q]);
+            aabb.extend(r);
+            for(Pptr& e : overflow)
+                if(aabb.covers(e.p))
+                    callback(q, e.ptr);
+        }
+    }
+    
+    
+    // Returns child c of i, creating it if needed; l is the child's level. Adding a child
+    // moves the sibling block to one a node larger. Leaves are swapped rather than copied
+    // so that every buffer keeps a single owner.
+    qt_int alloc_child(qt_int i, uint8_t c, qt_int l) {
+        uint8_t mask = nodes[i].mask;
+        qt_int r = Node::bits(mask & ((1 << c) - 1));
+        
+        if(mask & (1 << c))
+            return nodes[i].first + r;
+        
+        qt_int k = Node::bits(mask);
+        qt_int first = nodes[i].first;
+        qt_int b;
+        
+        if(l == 0) {
+            b = alloc_leaves(k + 1);
+            for(qt_int j = 0; j < r; ++j)
+                std::swap(leaves[b + j], leaves[first + j]);
+            for(qt_int j = r; j < k; ++j)
+                std::swap(leaves[b + j + 1], leaves[first + j]);
+            leaves[b + r].count = 0;
+            if(k > 0)
+                leafBlocks[k - 1].push_back(first);
+        }else{
+            b = alloc_block(k + 1);
+            for(qt_int j = 0; j < r; ++j)
+                nodes[b + j] = nodes[first + j];
+            for(qt_int j = r; j < k; ++j)
+                nodes[b + j + 1] = nodes[first + j];
+            nodes[b + r].init();
+            if(k > 0)
+                blocks[k - 1].push_back(first);
+        }
+        
+        nodes[i].first = b;
+        nodes[i].mask = mask | (1 << c);
+        
+        return b + r;
+    }
+    
+    // Descends on the integer cell floor(p / h) so that a point lands in the same leaf
+    // wherever the root happens to be centred.
+    void insert_tree(T* ptr, const vec2& p) {
+        int64_t side = (int64_t)1 << level;
+        int64_t x = std::min(std::max((int64_t)floorf(p.x / h) - origin(center.x), (int64_t)0), side - 1);
+        int64_t y = std::min(std::max((int64_t)floorf(p.y / h) - origin(center.y), (int64_t)0), side - 1);
+        
         qt_int i = root;
-        float d = rootSize * 0.5f;
-        vec2 n = p;
-        for(int _n = 0; _n < level; ++_n) {
-            d *= 0.5f;
-            
-            if(n.x >= 0.0f) {
-                if(n.y >= 0.0f) {
-                    alloc_child(i, 3);
-                    i = nodes[i][3];
-                    
-                    n.x -= d;
-                    n.y -= d;
-                }else{
-                    alloc_child(i, 1);
-                    i = nodes[i][1];
-                    
-                    n.x -= d;
-                    n.y += d;
+        for(qt_int l = level - 1; l >= 0; --l) {
+            uint8_t c = ((x >> l) & 1) | (((y >> l) & 1) << 1);
+            qt_int k = nodes[i].child(c);
+            i = k != -1 ? k : alloc_child(i, c, l);
+        }
+        
+        leaf(i).add(ptr);
+        ++population;
+    }
+    
+    void insert_pointer(T* ptr, const vec2& p) {
+        canonical = false;
+        aggregated = false;
+        
+        if(population > 0 && reaches(p)) {
+            grow_to(p);
+            insert_tree(ptr, p);
+            return;
+        }
+        
+        overflow.push_back(Pptr{ptr, p});
+        
+        if((qt_int)overflow.size() >= std::max(seed, population))
+            rebalance();
+    }
+    
+    // Same as calling insert_pointer(ptrs[j], positions[j]) in order, but the tree descents
+    // of up to `group` particles advance a level at a time together, each prefetching its
+    // next node, so their cache misses overlap. Particles bound for the overflow are added
+    // one by one after the pending descents have landed.
+    void insert_batch(T* const* ptrs, const vec2* positions, size_t n) {
+        T* gp[group];
+        vec2 gv[group];
+        int m = 0;
+        
+        canonical = false;
+        aggregated = false;
+        
+        for(size_t j = 0; j < n; ++j) {
+            const vec2& p = positions[j];
+            
+            if(population > 0 && reaches(p)) {
+                grow_to(p);
+                gp[m] = ptrs[j];
+                gv[m] = p;
+                if(++m == group) {
+                    insert_group(gp, gv, m);
+                    m = 0;
                 }
-            }else{
-                if(n.y >= 0.0f) {
-                    alloc_child(i, 2);
-                    i = nodes[i][2];
-                    
-                    n.x += d;
-                    n.y -= d;
+                continue;
+            }
+            
+            insert_group(gp, gv, m);
+            m = 0;
+            insert_pointer(ptrs[j], p);
+        }
+        
+        insert_group(gp, gv, m);
+    }
+    
+    // Starts a concurrent-insert phase for `threads` producers. Until end_concurrent, only
+    // insert_concurrent may be called, each thread passing its own index. The root is frozen
+    // for the phase: particles outside it wait in their lane and go through insert_batch at
+    // the end, as does everything while the tree is empty. Passing the expected bounds lets
+    // an empty tree be set up over them first.
+    void begin_concurrent(int threads) {
+        if(!concurrent)
+            concurrent.reset(new Concurrent());
+        
+        Concurrent& cc = *concurrent;
+        cc.reset(threads);
+        cc.level = population > 0 ? level : 0;
+        cc.side = (int64_t)1 << level;
+        cc.ox = origin(center.x);
+        cc.oy = origin(center.y);
+        cc.active = true;
+        canonical = false;
+        aggregated = false;
+    }
+    
+    void begin_concurrent(int threads, const AABB& bounds) {
+        if(population == 0) {
+            vec2 c = bounds.center();
+            center.x = floorf(c.x / h) * h;
+            center.y = floorf(c.y / h) * h;
+            grow_to(bounds.lowerBound);
+            grow_to(bounds.upperBound);
+        }
+        
+        begin_concurrent(threads);
+        concurrent->level = level;
+    }
+    
+    // Safe to call from many threads at once, one `thread` index per caller.
+    void insert_concurrent(int thread, T* ptr, const vec2& p) {
+        Concurrent& cc = *concurrent;
+        typename Concurrent::Lane& lane = cc.lanes[thread];
+        
+        int64_t x = (int64_t)floorf(p.x / h) - cc.ox;
+        int64_t y = (int64_t)floorf(p.y / h) - cc.oy;
+        
+        if(cc.level == 0 || x < 0 || y < 0 || x >= cc.side || y >= cc.side) {
+            lane.spillPtrs.push_back(ptr);
+            lane.spill.push_back(p);
+            return;
+        }
+        
+        qt_int b = 0;
+        for(qt_int l = cc.level - 1; l >= 0; --l) {
+            uint8_t c = ((x >> l) & 1) | (((y >> l) & 1) << 1);
+            std::atomic<qt_int>& slot = cc.block(b).child[c];
+            qt_int k = slot.load(std::memory_order_acquire);
+            
+            if(k == -1) {
+                qt_int n;
+                if(l > 0) {
+                    n = lane.spare != -1 ? lane.spare : cc.alloc();
+                    lane.spare = -1;
+                    if(n == -1) {
+                        lane.spillPtrs.push_back(ptr);
+                        lane.spill.push_back(p);
+                        return;
+                    }
                 }else{
-                    alloc_child(i, 0);
-                    i = nodes[i][0];
-                    
-                    n.x += d;
-                    n.y += d;
+                    n = cc.cells.fetch_add(1, std::memory_order_relaxed);
                 }
+                
+                if(slot.compare_exchange_strong(k, n, std::memory_order_acq_rel, std::memory_order_acquire))
+                    k = n;
+                else if(l > 0)
+                    lane.spare = n;
             }
             
+            b = k;
         }
         
-        nodes[i].add(ptr);
+        lane.members.push_back(std::make_pair(b, ptr));
+    }
+    
+    // The sync point: once every producer is done, merges the lanes into the tree.
+    void end_concurrent() {
+        Concurrent& cc = *concurrent;
+        if(!cc.active) return;
+        cc.active = false;
+        
+        qt_int cells = cc.cells.load(std::memory_order_relaxed);
+        cc.offsets.assign(cells + 1, 0);
+        
+        qt_int total = 0;
+        for(int i = 0; i < cc.threads; ++i) {
+            for(auto& e : cc.lanes[i].members)
+                ++cc.offsets[e.first + 1];
+            total += (qt_int)cc.lanes[i].members.size();
+        }
+        
+        for(qt_int i = 0; i < cells; ++i)
+            cc.offsets[i + 1] += cc.offsets[i];
+        
+        cc.sorted.resize(total);
+        std::vector<qt_int> cursor(cc.offsets.begin(), cc.offsets.end() - 1);
+        for(int i = 0; i < cc.threads; ++i)
+            for(auto& e : cc.lanes[i].members)
+                cc.sorted[cursor[e.first]++] = e.second;
+        
+        if(total > 0) {
+            merge_node(0, root, level);
+            population += total;
+        }
+        
+        for(int i = 0; i < cc.threads; ++i)
+            insert_batch(cc.lanes[i].spillPtrs.data(), cc.lanes[i].spill.data(), cc.lanes[i].spill.size());
     }
 };
 
+template <class T, class _Less>
+const qt_int DynamicQuadTree<T, _Less>::seed;
+
+template <class T, class _Less>
+const qt_int DynamicQuadTree<T, _Less>::slack;
+
 #endif /* DynamicQuadTree_h */
 
@@ -0,0 +1,217 @@
+//
+//  PerfCounters.h
+//  DynamicQuadTree
+//
+
+#ifndef PerfCounters_h
+#define PerfCounters_h
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Per-thread hardware counters through perf_event_open. Every event is opened on its own,
+// so a VM or kernel that refuses some of them (or all, as on other platforms) still
+// reports the rest; an unavailable event reads as -1 and prints as null. Counts cover
+// user space only and are scaled for multiplexing. start / stop accumulate.
+class PerfCounters
+{
+
+public:
+
+    enum Event
+    {
+        cycles,
+        instructions,
+        l1Misses,
+        llcMisses,
+        branchMisses,
+        tlbMisses,
+        taskClock,
+        events
+    };
+
+protected:
+
+    int fds[events];
+    double counts[events];
+
+#ifdef __linux__
+    struct Reading
+    {
+        uint64_t value;
+        uint64_t enabled;
+        uint64_t running;
+    };
+
+    Reading begin[events];
+
+    static inline uint64_t cache(uint64_t id, uint64_t op, uint64_t result)
+    {
+        return id | (op << 8) | (result << 16);
+    }
+
+    static int open(Event e) {
+        perf_event_attr a;
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.disabled = 1;
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch(e) {
+            case cycles:
+                a.type = PERF_TYPE_HARDWARE;
+                a.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case instructions:
+                a.type = PERF_TYPE_HARDWARE;
+                a.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case l1Misses:
+                a.type = PERF_TYPE_HW_CACHE;
+                a.config = cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+                break;
+            case llcMisses:
+                a.type = PERF_TYPE_HARDWARE;
+                a.config = PERF_COUNT_HW_CACHE_MISSES;
+                break;
+            case branchMisses:
+                a.type = PERF_TYPE_HARDWARE;
+                a.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case tlbMisses:
+                a.type = PERF_TYPE_HW_CACHE;
+                a.config = cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS);
+                break;
+            default:
+                a.type = PERF_TYPE_SOFTWARE;
+                a.config = PERF_COUNT_SW_TASK_CLOCK;
+                break;
+        }
+
+        return (int)syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+    }
+
+    inline bool sample(int i, Reading& r) const
+    {
+        return ::read(fds[i], &r, sizeof(r)) == (ssize_t)sizeof(r);
+    }
+#endif
+
+public:
+
+    PerfCounters() {
+        for(int i = 0; i < events; ++i) {
+#ifdef __linux__
+            fds[i] = open((Event)i);
+#else
+            fds[i] = -1;
+#endif
+        }
+        reset();
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for(int i = 0; i < events; ++i)
+            if(fds[i] != -1)
+                close(fds[i]);
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator = (const PerfCounters&) = delete;
+
+    inline bool available(Event e) const
+    {
+        return fds[e] != -1;
+    }
+
+    // True if at least one hardware event opened.
+    inline bool hardware() const
+    {
+        for(int i = 0; i < taskClock; ++i)
+            if(fds[i] != -1)
+                return true;
+        return false;
+    }
+
+    inline void reset() {
+        for(int i = 0; i < events; ++i)
+            counts[i] = fds[i] != -1 ? 0.0 : -1.0;
+    }
+
+    void start() {
+#ifdef __linux__
+        for(int i = 0; i < events; ++i) {
+            if(fds[i] == -1) continue;
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            if(!sample(i, begin[i]))
+                begin[i] = Reading{0, 0, 0};
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for(int i = 0; i < events; ++i) {
+            if(fds[i] == -1) continue;
+            Reading r;
+            bool ok = sample(i, r);
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if(!ok) continue;
+
+            double value = (double)(r.value - begin[i].value);
+            uint64_t enabled = r.enabled - begin[i].enabled;
+            uint64_t running = r.running - begin[i].running;
+            if(running > 0 && running < enabled)
+                value *= (double)enabled / running;
+            counts[i] += value;
+        }
+#endif
+    }
+
+    inline double operator [] (Event e) const
+    {
+        return counts[e];
+    }
+
+    static inline const char* name(Event e)
+    {
+        static const char* names[events] = {
+            "cycles",
+            "instructions",
+            "l1_misses",
+            "llc_misses",
+            "branch_misses",
+            "dtlb_misses",
+            "task_clock_ns"
+        };
+        return names[e];
+    }
+
+    // {"cycles": ..., ...} with every count divided by `per`.
+    void print_json(FILE* f, double per = 1.0) const
+    {
+        fprintf(f, "{");
+        for(int i = 0; i < events; ++i) {
+            fprintf(f, "%s\"%s\": ", i > 0 ? ", " : "", name((Event)i));
+            if(counts[i] < 0.0 || per <= 0.0)
+                fprintf(f, "null");
+            else
+                fprintf(f, "%.6g", counts[i] / per);
+        }
+        fprintf(f, "}");
+    }
+};
+
+#endif /* PerfCounters_h */
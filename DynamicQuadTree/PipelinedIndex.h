@@ -0,0 +1,90 @@
+//
+//  PipelinedIndex.h
+//  DynamicQuadTree
+//
+
+#ifndef PipelinedIndex_h
+#define PipelinedIndex_h
+
+#include <future>
+#include <memory>
+#include <vector>
+#include "vec2.h"
+
+// Double-buffered DynamicQuadTree / DynamicHashGrid. build_async fills the back index on a
+// worker thread while the front one is solved; swap waits for the build and exchanges them.
+// The front index is one frame stale, so solvers should re-check distances against an
+// interaction radius grown by a skin when positions move in between.
+template <class _Index, class T>
+class PipelinedIndex
+{
+
+protected:
+
+    std::unique_ptr<_Index> front;
+    std::unique_ptr<_Index> back;
+
+    T* base;
+    std::vector<vec2> positions;
+
+    std::future<void> pending;
+
+    void launch() {
+        pending = std::async(std::launch::async, [this] () {
+            back->clear();
+            size_t n = positions.size();
+            for(size_t i = 0; i < n; ++i)
+                back->insert_pointer(base + i, positions[i]);
+        });
+    }
+
+public:
+
+    PipelinedIndex(float h) : front(new _Index(h)), back(new _Index(h)), base(nullptr) {}
+
+    ~PipelinedIndex() {
+        wait();
+    }
+
+    inline _Index& current()
+    {
+        return *front;
+    }
+
+    // Builds the next index over base[0, n). Positions are copied first, so the caller may
+    // integrate them while the build runs.
+    void build_async(T* _base, const vec2* _positions, size_t n) {
+        wait();
+        base = _base;
+        positions.assign(_positions, _positions + n);
+        launch();
+    }
+
+    template <class _Position>
+    void build_async(T* _base, size_t n, _Position position) {
+        wait();
+        base = _base;
+        positions.resize(n);
+        for(size_t i = 0; i < n; ++i)
+            positions[i] = position(_base + i);
+        launch();
+    }
+
+    inline bool ready() const
+    {
+        return !pending.valid() || pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    inline void wait() {
+        if(pending.valid())
+            pending.get();
+    }
+
+    // Fence: waits for the pending build and makes it current.
+    void swap() {
+        wait();
+        std::swap(front, back);
+    }
+};
+
+#endif /* PipelinedIndex_h */
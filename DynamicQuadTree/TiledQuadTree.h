@@ -0,0 +1,476 @@
+//
+//  TiledQuadTree.h
+//  DynamicQuadTree
+//
+
+#ifndef TiledQuadTree_h
+#define TiledQuadTree_h
+
+#include <cmath>
+#include <cstdio>
+#include <cerrno>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <algorithm>
+#include "DynamicQuadTree.h"
+
+// The world is cut into square tiles of size tileSize. Each tile owns its particles
+// by value, is indexed by its own DynamicQuadTree and lives in <directory>/<x>_<y>.tile
+// when it is not resident. At most `capacity` tiles are kept in memory (LRU), plus at
+// most `capacity` prefetched ones waiting to be used.
+template <class T>
+class TiledQuadTree
+{
+
+    static_assert(std::is_trivially_copyable<T>::value, "tiles are written to disk as raw bytes");
+
+protected:
+
+    struct Item
+    {
+        T value;
+        vec2 p;
+    };
+
+    struct Tile
+    {
+        std::vector<Item> items;
+        std::unique_ptr<DynamicQuadTree<T>> tree;
+        std::list<uint64_t>::iterator lru;
+        bool dirty;
+        bool built;
+    };
+
+    float h;
+    float tileSize;
+
+    std::string directory;
+    size_t capacity;
+
+    std::unordered_map<uint64_t, Tile> tiles;
+    std::list<uint64_t> lru;
+
+    std::unordered_map<uint64_t, std::future<std::vector<Item>>> pending;
+    
+    // Tiles the current solve step holds references to; evict() leaves them alone.
+    std::vector<uint64_t> pinned;
+    
+    // Background loads run on a fixed set of workers.
+    static const int loaders = 2;
+    
+    std::vector<std::thread> workers;
+    std::deque<std::pair<uint64_t, std::packaged_task<std::vector<Item>()>>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+    
+    void work() {
+        for(;;) {
+            std::packaged_task<std::vector<Item>()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] () { return stopping || !jobs.empty(); });
+                if(jobs.empty()) return;
+                job = std::move(jobs.front().second);
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    static inline uint64_t key(int32_t x, int32_t y)
+    {
+        return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+    }
+
+    inline int32_t tile_coord(float x) const
+    {
+        return (int32_t)floorf(x / tileSize);
+    }
+
+    inline AABB tile_bounds(int32_t x, int32_t y) const
+    {
+        return AABB(vec2(x * tileSize, y * tileSize), vec2((x + 1) * tileSize, (y + 1) * tileSize));
+    }
+
+    std::string path(int32_t x, int32_t y) const
+    {
+        return directory + "/" + std::to_string(x) + "_" + std::to_string(y) + ".tile";
+    }
+
+    // A missing file is an empty tile. A damaged one is moved aside to <file>.corrupt, so a
+    // later store cannot overwrite it, and whatever items were intact are kept.
+    static std::vector<Item> load(const std::string& file)
+    {
+        std::vector<Item> items;
+        FILE* f = fopen(file.c_str(), "rb");
+        if(f == nullptr) {
+            if(errno != ENOENT)
+                printf("Cannot read tile %s. \n", file.c_str());
+            return items;
+        }
+
+        // The count is only trusted as far as the file can back it.
+        long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+        rewind(f);
+
+        bool intact = false;
+        uint64_t count = 0;
+        if(size >= (long)sizeof(count) && fread(&count, sizeof(count), 1, f) == 1) {
+            uint64_t fits = (uint64_t)(size - sizeof(count)) / sizeof(Item);
+            items.resize(std::min(count, fits));
+            size_t n = fread(items.data(), sizeof(Item), items.size(), f);
+            items.resize(n);
+            intact = n == count && fgetc(f) == EOF && !ferror(f);
+        }
+
+        fclose(f);
+
+        if(!intact) {
+            printf("Corrupt tile %s, kept %zu items. \n", file.c_str(), items.size());
+            rename(file.c_str(), (file + ".corrupt").c_str());
+        }
+
+        return items;
+    }
+
+    // Writes through <file>.tmp and renames it over the tile, so a failed write leaves the
+    // old file in place. Returns whether the tile is safely on disk.
+    static bool store(const std::string& file, const std::vector<Item>& items)
+    {
+        if(items.empty()) {
+            if(remove(file.c_str()) != 0 && errno != ENOENT) {
+                printf("Cannot remove tile %s. \n", file.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        std::string tmp = file + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if(f == nullptr) {
+            printf("Cannot write tile %s. \n", file.c_str());
+            return false;
+        }
+
+        uint64_t count = items.size();
+        bool ok = fwrite(&count, sizeof(count), 1, f) == 1;
+        ok = ok && fwrite(items.data(), sizeof(Item), count, f) == count;
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp.c_str(), file.c_str()) == 0;
+
+        if(!ok) {
+            printf("Cannot write tile %s. \n", file.c_str());
+            remove(tmp.c_str());
+        }
+
+        return ok;
+    }
+
+    // Drops least recently used tiles other than `keep` and the pinned ones. A dirty tile
+    // that cannot be stored stays resident and dirty, and is retried on the next eviction.
+    void evict(uint64_t keep) {
+        auto it = lru.end();
+        while(tiles.size() > capacity && it != lru.begin()) {
+            --it;
+            uint64_t k = *it;
+            if(k == keep || std::find(pinned.begin(), pinned.end(), k) != pinned.end()) continue;
+
+            Tile& t = tiles[k];
+            if(t.dirty && !store(path((int32_t)(k >> 32), (int32_t)(uint32_t)k), t.items))
+                continue;
+
+            it = lru.erase(it);
+            tiles.erase(k);
+        }
+    }
+
+    // acquire() that keeps the tile resident until the pins are cleared.
+    Tile& pin(int32_t x, int32_t y) {
+        pinned.push_back(key(x, y));
+        return acquire(x, y);
+    }
+
+    Tile& acquire(int32_t x, int32_t y) {
+        uint64_t k = key(x, y);
+
+        auto it = tiles.find(k);
+        if(it != tiles.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second;
+        }
+
+        Tile& t = tiles[k];
+
+        auto f = pending.find(k);
+        if(f != pending.end()) {
+            t.items = f->second.get();
+            pending.erase(f);
+        }else{
+            t.items = load(path(x, y));
+        }
+
+        t.dirty = false;
+        t.built = false;
+        lru.push_front(k);
+        t.lru = lru.begin();
+
+        evict(k);
+
+        return tiles[k];
+    }
+
+    void build(Tile& t, int32_t x, int32_t y) {
+        if(t.built) return;
+
+        if(!t.tree)
+            t.tree.reset(new DynamicQuadTree<T>(h));
+        else
+            t.tree->clear();
+
+        vec2 c = tile_bounds(x, y).center();
+        for(Item& e : t.items)
+            t.tree->insert_pointer(&e.value, e.p - c);
+
+        t.built = true;
+    }
+
+    // Pairs across the shared edge of a tile and its neighbour in +x (axis 0) or +y (axis 1).
+    template <class _Solver>
+    void solve_edge(Tile& a, Tile& b, const AABB& ab, int axis, _Solver& solver) {
+        float lo = (axis == 0 ? ab.upperBound.x : ab.upperBound.y) - h;
+        float hi = (axis == 0 ? ab.upperBound.x : ab.upperBound.y) + h;
+
+        std::vector<Item*> sa;
+        std::vector<Item*> sb;
+
+        for(Item& e : a.items)
+            if((axis == 0 ? e.p.x : e.p.y) >= lo) sa.push_back(&e);
+
+        for(Item& e : b.items)
+            if((axis == 0 ? e.p.x : e.p.y) < hi) sb.push_back(&e);
+
+        if(sa.empty() || sb.empty()) return;
+
+        auto along = [axis] (const Item* e) { return axis == 0 ? e->p.y : e->p.x; };
+        auto less = [&along] (const Item* u, const Item* v) { return along(u) < along(v); };
+
+        std::sort(sa.begin(), sa.end(), less);
+        std::sort(sb.begin(), sb.end(), less);
+
+        size_t first = 0;
+        for(Item* e : sa) {
+            float s = along(e);
+            while(first < sb.size() && along(sb[first]) < s - h) ++first;
+            for(size_t j = first; j < sb.size() && along(sb[j]) <= s + h; ++j) {
+                vec2 d = sb[j]->p - e->p;
+                if(fabsf(d.x) <= h && fabsf(d.y) <= h)
+                    solver(&e->value, &sb[j]->value);
+            }
+        }
+    }
+
+    // Pairs across the corner shared by a tile and its diagonal neighbour at `corner`.
+    template <class _Solver>
+    void solve_corner(Tile& a, Tile& b, const vec2& corner, _Solver& solver) {
+        AABB box(corner);
+        box.extend(h);
+
+        std::vector<Item*> sb;
+        for(Item& e : b.items)
+            if(box.covers(e.p)) sb.push_back(&e);
+
+        if(sb.empty()) return;
+
+        for(Item& e : a.items) {
+            if(!box.covers(e.p)) continue;
+            for(Item* f : sb) {
+                vec2 d = f->p - e.p;
+                if(fabsf(d.x) <= h && fabsf(d.y) <= h)
+                    solver(&e.value, &f->value);
+            }
+        }
+    }
+
+public:
+
+    // solve holds a tile and its four forward neighbours at once, so at least five stay resident.
+    TiledQuadTree(float h, float tileSize, const std::string& directory, size_t capacity = 64) : h(h), tileSize(std::max(tileSize, h)), directory(directory), capacity(std::max(capacity, (size_t)5)), stopping(false) {
+        for(int i = 0; i < loaders; ++i)
+            workers.emplace_back([this] () { work(); });
+    }
+
+    ~TiledQuadTree() {
+        flush();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for(std::thread& w : workers)
+            w.join();
+    }
+
+    // Writes every dirty resident tile back to disk. Returns false if any could not be
+    // stored; those stay dirty.
+    bool flush() {
+        for(auto& f : pending)
+            f.second.wait();
+
+        bool ok = true;
+        for(auto& t : tiles) {
+            if(!t.second.dirty) continue;
+            if(store(path((int32_t)(t.first >> 32), (int32_t)(uint32_t)t.first), t.second.items))
+                t.second.dirty = false;
+            else
+                ok = false;
+        }
+        return ok;
+    }
+
+    // Starts loading the ring of tiles just outside `region` in the background, at most
+    // `capacity` loads at a time. Loads for tiles outside the region and its ring are
+    // dropped, queued ones unstarted.
+    void prefetch(const AABB& region) {
+        int32_t x0 = tile_coord(region.lowerBound.x) - 1;
+        int32_t y0 = tile_coord(region.lowerBound.y) - 1;
+        int32_t x1 = tile_coord(region.upperBound.x) + 1;
+        int32_t y1 = tile_coord(region.upperBound.y) + 1;
+
+        auto outside = [=] (uint64_t k) {
+            int32_t x = (int32_t)(k >> 32);
+            int32_t y = (int32_t)(uint32_t)k;
+            return x < x0 || x > x1 || y < y0 || y > y1;
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&] (const std::pair<uint64_t, std::packaged_task<std::vector<Item>()>>& j) { return outside(j.first); }), jobs.end());
+        }
+
+        for(auto it = pending.begin(); it != pending.end();) {
+            if(outside(it->first))
+                it = pending.erase(it);
+            else
+                ++it;
+        }
+
+        for(int32_t y = y0; y <= y1; ++y) {
+            int32_t step = (y == y0 || y == y1) ? 1 : x1 - x0;
+            for(int32_t x = x0; x <= x1; x += std::max(step, 1)) {
+                if(pending.size() >= capacity) return;
+
+                uint64_t k = key(x, y);
+                if(tiles.count(k) || pending.count(k)) continue;
+
+                std::packaged_task<std::vector<Item>()> job(std::bind(load, path(x, y)));
+                pending[k] = job.get_future();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    jobs.push_back(std::make_pair(k, std::move(job)));
+                }
+                wake.notify_one();
+            }
+        }
+    }
+
+    void insert(const T& value, const vec2& p) {
+        int32_t x = tile_coord(p.x);
+        int32_t y = tile_coord(p.y);
+
+        Tile& t = acquire(x, y);
+        t.items.push_back(Item{value, p});
+        t.dirty = true;
+        t.built = false;
+    }
+
+    // Calls callback(T*) for every particle inside `region`. Modifications are written back.
+    template <class _Callback>
+    void query(const AABB& region, _Callback callback) {
+        prefetch(region);
+
+        int32_t x0 = tile_coord(region.lowerBound.x);
+        int32_t y0 = tile_coord(region.lowerBound.y);
+        int32_t x1 = tile_coord(region.upperBound.x);
+        int32_t y1 = tile_coord(region.upperBound.y);
+
+        for(int32_t y = y0; y <= y1; ++y) {
+            for(int32_t x = x0; x <= x1; ++x) {
+                Tile& t = acquire(x, y);
+                for(Item& e : t.items) {
+                    if(region.covers(e.p)) {
+                        callback(&e.value);
+                        t.dirty = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Solves every particle of the tiles touching `region`, including the pairs that cross
+    // the seams between those tiles. The same candidate pairs as DynamicQuadTree::solve are
+    // passed to the solver, so it still has to check the actual distance.
+    template <class _Solver>
+    void solve(const AABB& region, _Solver solver) {
+        prefetch(region);
+        pinned.clear();
+
+        int32_t x0 = tile_coord(region.lowerBound.x);
+        int32_t y0 = tile_coord(region.lowerBound.y);
+        int32_t x1 = tile_coord(region.upperBound.x);
+        int32_t y1 = tile_coord(region.upperBound.y);
+
+        for(int32_t y = y0; y <= y1; ++y) {
+            for(int32_t x = x0; x <= x1; ++x) {
+                AABB ab = tile_bounds(x, y);
+
+                pinned.clear();
+                Tile& a = pin(x, y);
+                if(a.items.empty()) continue;
+
+                build(a, x, y);
+                a.tree->solve(solver);
+                a.dirty = true;
+
+                if(x < x1) {
+                    Tile& b = pin(x + 1, y);
+                    solve_edge(a, b, ab, 0, solver);
+                    b.dirty = true;
+                }
+
+                if(y < y1) {
+                    Tile& b = pin(x, y + 1);
+                    solve_edge(a, b, ab, 1, solver);
+                    b.dirty = true;
+
+                    if(x < x1) {
+                        Tile& c = pin(x + 1, y + 1);
+                        solve_corner(a, c, ab.upperBound, solver);
+                        c.dirty = true;
+                    }
+
+                    if(x > x0) {
+                        Tile& c = pin(x - 1, y + 1);
+                        solve_corner(a, c, vec2(ab.lowerBound.x, ab.upperBound.y), solver);
+                        c.dirty = true;
+                    }
+                }
+            }
+        }
+
+        pinned.clear();
+    }
+};
+
+#endif /* TiledQuadTree_h */
@@ -10,6 +10,9 @@
 #include <cmath>
 #include "DynamicQuadTree.h"
 #include "DynamicHashGrid.h"
+#include "PipelinedIndex.h"
+#include "AdaptiveIndex.h"
+#include "PerfCounters.h"
 
 std::vector<unsigned long> clocks;
 
@@ -37,6 +40,8 @@ float h2 = h * h;
 
 DynamicQuadTree<particle> qt(h);
 DynamicHashGrid<particle> hg(h);
+PipelinedIndex<DynamicQuadTree<particle>, particle> pqt(h);
+AdaptiveIndex<particle> ai(h);
 
 inline float weight(const vec2& d) {
     float u = 1.0f - d.magSq() / h2;
@@ -76,13 +81,108 @@ void solve_part(particle* a, particle* b) {
 
 const int n = 100000;
 
+randx4 rng(1);
+
+// Random rays in the k x k square, four at a time.
+void make_rays(std::vector<vec2>& origins, std::vector<vec2>& dirs) {
+    float x[4], y[4], a[4];
+    for(size_t i = 0; i < origins.size(); i += 4) {
+        rng.next(-k * 0.5f, k * 0.5f).store(x);
+        rng.next(-k * 0.5f, k * 0.5f).store(y);
+        rng.next(0.0f, 6.2831853f).store(a);
+        for(size_t j = 0; j < 4 && i + j < origins.size(); ++j) {
+            origins[i + j] = vec2(x[j], y[j]);
+            dirs[i + j] = vec2(cosf(a[j]), sinf(a[j]));
+        }
+    }
+}
+
+vec2 rayOrigin;
+vec2 rayDir;
+float rayRadius = 0.25f;
+
+// First entry of the ray into the disc of radius rayRadius around a.
+float ray_part(particle* a, float maxT) {
+    vec2 w = a->p - rayOrigin;
+    float s = dot(w, rayDir);
+    vec2 c = w - s * rayDir;
+    float e = rayRadius * rayRadius - c.magSq();
+    if(e < 0.0f) return maxT;
+    e = sqrtf(e);
+    if(s + e < 0.0f) return maxT;
+    return std::min(maxT, std::max(0.0f, s - e));
+}
+
 inline float calc_ms(int i)
 {
     return 1000.0f * (clocks[i + 1] - clocks[i]) / (float) CLOCKS_PER_SEC;
 }
 
+template <class _Body>
+void profile_phase(PerfCounters& pc, const char* phase, const char* unit, size_t count, bool last, _Body body) {
+    pc.reset();
+    auto wall = std::chrono::steady_clock::now();
+    pc.start();
+    body();
+    pc.stop();
+    float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wall).count();
+    
+    printf("        {\"phase\": \"%s\", \"ms\": %.5f, \"%s\": %zu, \"total\": ", phase, ms, unit, count);
+    pc.print_json(stdout);
+    printf(", \"per\": ");
+    pc.print_json(stdout, (double)count);
+    printf("}%s\n", last ? "" : ",");
+}
+
+// Build, solve and raycast phases of one backend; solve figures are per candidate pair.
+template <class _Index>
+void profile_index(PerfCounters& pc, const char* name, _Index& index, particle* dots, const std::vector<vec2>& origins, const std::vector<vec2>& dirs, bool last) {
+    printf("    {\"backend\": \"%s\", \"phases\": [\n", name);
+    
+    profile_phase(pc, "build", "particles", n, false, [&] () {
+        index.clear();
+        for(int i = 0; i < n; ++i)
+            index.insert_pointer(dots + i, dots[i].p);
+    });
+    
+    u1 = 0;
+    u2 = 0;
+    index.solve(solve_part);
+    size_t pairs = u1;
+    
+    profile_phase(pc, "solve", "pairs", pairs, false, [&] () {
+        index.solve(solve_part);
+    });
+    
+    profile_phase(pc, "raycast", "rays", origins.size(), true, [&] () {
+        for(size_t i = 0; i < origins.size(); ++i) {
+            rayOrigin = origins[i];
+            rayDir = dirs[i];
+            index.raycast(rayOrigin, rayDir, k, ray_part, rayRadius);
+        }
+    });
+    
+    printf("    ]}%s\n", last ? "" : ",");
+}
+
+// --profile: one JSON object on stdout instead of the timings below. Counters the host
+// refuses are null; ms is wall time either way.
+void profile(particle* dots) {
+    const int rays = 10000;
+    std::vector<vec2> origins(rays);
+    std::vector<vec2> dirs(rays);
+    make_rays(origins, dirs);
+    
+    PerfCounters pc;
+    
+    printf("{\"particles\": %d, \"h\": %.5f, \"hardware\": %s, \"backends\": [\n", n, h, pc.hardware() ? "true" : "false");
+    profile_index(pc, "DynamicQuadTree", qt, dots, origins, dirs, false);
+    profile_index(pc, "DynamicHashGrid", hg, dots, origins, dirs, true);
+    printf("]}\n");
+}
+
 int main(int argc, const char * argv[]) {
-    srand((unsigned int)time(0));
+    rng = randx4((uint32_t)time(0));
     particle *dots;
     particle *dots1;
     particle *dots2;
@@ -93,13 +193,25 @@ int main(int argc, const char * argv[]) {
     
     dots[0].p.set(10000000.0f, 0.0f);
     
-    for(int i = 1; i < n; ++i) {
-        dots[i].p = vec2(randFlt(-k * 0.5f, k * 0.5f), randFlt(-k * 0.5f, k * 0.5f));
+    float x[4], y[4];
+    for(int i = 1; i < n; i += 4) {
+        rng.next(-k * 0.5f, k * 0.5f).store(x);
+        rng.next(-k * 0.5f, k * 0.5f).store(y);
+        for(int j = 0; j < 4 && i + j < n; ++j)
+            dots[i + j].p = vec2(x[j], y[j]);
     }
     
     memcpy(dots1, dots, sizeof(particle) * n);
     memcpy(dots2, dots, sizeof(particle) * n);
     
+    if(argc > 1 && strcmp(argv[1], "--profile") == 0) {
+        profile(dots);
+        free(dots);
+        free(dots1);
+        free(dots2);
+        return 0;
+    }
+    
     clocks.push_back(clock());
     
     for(int i = 0; i < n; ++i) {
@@ -153,6 +265,136 @@ int main(int argc, const char * argv[]) {
     printf("DynamicQuadTree: %.5f ms\n", calc_ms(2)/(float)s);
     printf("DynamicHashGrid: %.5f ms\n", calc_ms(3)/(float)s);
     
+    const int rays = 10000;
+    std::vector<vec2> origins(rays);
+    std::vector<vec2> dirs(rays);
+    make_rays(origins, dirs);
+    
+    float qtr = 0.0f;
+    float hgr = 0.0f;
+    
+    clocks.push_back(clock());
+    
+    for(int i = 0; i < rays; ++i) {
+        rayOrigin = origins[i];
+        rayDir = dirs[i];
+        qtr += qt.raycast(rayOrigin, rayDir, k, ray_part, rayRadius);
+    }
+    
+    clocks.push_back(clock());
+    
+    for(int i = 0; i < rays; ++i) {
+        rayOrigin = origins[i];
+        rayDir = dirs[i];
+        hgr += hg.raycast(rayOrigin, rayDir, k, ray_part, rayRadius);
+    }
+    
+    clocks.push_back(clock());
+    
+    printf("qt r: %.5f ms (%.3f)\n", calc_ms(6), qtr / rays);
+    printf("hg r: %.5f ms (%.3f)\n", calc_ms(7), hgr / rays);
+    
+    const int frames = 8;
+    auto position = [] (particle* a) { return a->p; };
+    
+    auto wall = std::chrono::steady_clock::now();
+    
+    for(int f = 0; f < frames; ++f) {
+        qt.clear();
+        for(int i = 0; i < n; ++i)
+            qt.insert_pointer(dots + i, dots[i].p);
+        qt.solve(solve_part);
+    }
+    
+    float sms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wall).count();
+    
+    wall = std::chrono::steady_clock::now();
+    
+    pqt.build_async(dots, n, position);
+    for(int f = 0; f < frames; ++f) {
+        pqt.swap();
+        pqt.build_async(dots, n, position);
+        pqt.current().solve(solve_part);
+    }
+    pqt.wait();
+    
+    float pms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wall).count();
+    
+    printf("qt frame: %.5f ms (wall)\n", sms/(float)frames);
+    printf("qt pipelined frame: %.5f ms (wall)\n", pms/(float)frames);
+    
+    qt.deterministic = true;
+    hg.deterministic = true;
+    
+    clocks.push_back(clock());
+    
+    for(int n = 0; n < s; ++n)
+        qt.solve(solve_part);
+    
+    clocks.push_back(clock());
+    
+    for(int n = 0; n < s; ++n)
+        hg.solve(solve_part);
+    
+    clocks.push_back(clock());
+    
+    printf("qt deterministic: %.5f ms\n", calc_ms(9)/(float)s);
+    printf("hg deterministic: %.5f ms\n", calc_ms(10)/(float)s);
+    
+    const char* backends[] = { "tree", "grid" };
+    
+    wall = std::chrono::steady_clock::now();
+    
+    for(int f = 0; f < 4 * frames; ++f) {
+        ai.clear();
+        for(int i = 0; i < n; ++i)
+            ai.insert_pointer(dots + i, dots[i].p);
+        ai.solve(solve_part);
+    }
+    
+    float ams = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wall).count();
+    
+    const AdaptiveIndex<particle>::Stats& as = ai.stats();
+    printf("adaptive frame: %.5f ms (wall), %s x%.1f, occupancy %.3f, e: %.5f \n", ams/(float)(4 * frames), backends[ai.config().backend], ai.config().scale, as.occupancy, as.ratio);
+    
+    std::vector<particle*> ptrs(n);
+    std::vector<vec2> positions(n);
+    
+    for(int i = 0; i < n; ++i) {
+        ptrs[i] = dots + i;
+        positions[i] = dots[i].p;
+    }
+    
+    clocks.push_back(clock());
+    
+    qt.clear();
+    qt.insert_batch(ptrs.data(), positions.data(), n);
+    
+    clocks.push_back(clock());
+    
+    printf("qt batch i: %.5f ms\n", calc_ms(12));
+    
+    const int producers = 4;
+    std::vector<std::future<void>> jobs;
+    
+    wall = std::chrono::steady_clock::now();
+    
+    qt.clear();
+    qt.begin_concurrent(producers, AABB(vec2(-k * 0.5f), vec2(k * 0.5f)));
+    for(int t = 0; t < producers; ++t) {
+        jobs.push_back(std::async(std::launch::async, [t, dots] () {
+            for(int i = t; i < n; i += producers)
+                qt.insert_concurrent(t, dots + i, dots[i].p);
+        }));
+    }
+    for(auto& j : jobs)
+        j.get();
+    qt.end_concurrent();
+    
+    float cms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - wall).count();
+    
+    printf("qt concurrent i: %.5f ms (wall, %d producers)\n", cms, producers);
+    
     //printf("%d, %d collisions \n", u1, u2);
     
     free(dots);
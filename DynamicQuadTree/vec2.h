@@ -9,6 +9,9 @@
 #ifndef vec2_h
 #define vec2_h
 
+#include <cstdint>
+#include <cstring>
+
 struct vec2
 {
     float x;
@@ -109,16 +112,31 @@ inline vec2 mul (const vec2& a, const vec2& b)
 }
 
 inline float invSqrt(float f) {
-    long i = *(long*)&f;
+    int32_t i;
+    memcpy(&i, &f, sizeof(i));
     i = 0x5f3759df - (i >> 1);
     float f2 = f * 0.5f;
-    f = *(float*)&i;
+    memcpy(&f, &i, sizeof(f));
     f *= (1.5f - (f2 * f * f));
     return f;
 }
 
+inline uint32_t& randState() {
+    static uint32_t s = 2463534242u;
+    return s;
+}
+
+inline void randSeed(uint32_t seed) {
+    randState() = seed | 1;
+}
+
+// xorshift32, uniform in [0, 1].
 inline float randFlt() {
-    return rand() / (float) RAND_MAX;
+    uint32_t& s = randState();
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return (s >> 8) * (1.0f / 16777215.0f);
 }
 
 inline float randFlt(float a, float b) {
@@ -0,0 +1,355 @@
+//
+//  vec2simd.h
+//  DynamicQuadTree
+//
+
+#ifndef vec2simd_h
+#define vec2simd_h
+
+#include <cstdint>
+#include <algorithm>
+#include "AABB.h"
+
+// Batch (SoA) counterparts of vec2.h/AABB.h: floatx4 / vec2x4 over SSE or NEON and floatx8 /
+// vec2x8 over AVX, each with a scalar fallback (forced with VEC2_NO_SIMD). Comparisons return
+// lane bitmasks as plain ints, lane i in bit i.
+
+#if !defined(VEC2_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define VEC2_SSE 1
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define VEC2_AVX 1
+#include <immintrin.h>
+#endif
+#elif !defined(VEC2_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define VEC2_NEON 1
+#include <arm_neon.h>
+#endif
+
+struct floatx4
+{
+#if VEC2_SSE
+    __m128 v;
+
+    floatx4() {}
+    floatx4(__m128 v) : v(v) {}
+    floatx4(float a) : v(_mm_set1_ps(a)) {}
+
+    static inline floatx4 load(const float* p) { return _mm_loadu_ps(p); }
+    inline void store(float* p) const { _mm_storeu_ps(p, v); }
+#elif VEC2_NEON
+    float32x4_t v;
+
+    floatx4() {}
+    floatx4(float32x4_t v) : v(v) {}
+    floatx4(float a) : v(vdupq_n_f32(a)) {}
+
+    static inline floatx4 load(const float* p) { return vld1q_f32(p); }
+    inline void store(float* p) const { vst1q_f32(p, v); }
+#else
+    float v[4];
+
+    floatx4() {}
+    floatx4(float a) { v[0] = v[1] = v[2] = v[3] = a; }
+
+    static inline floatx4 load(const float* p) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = p[i]; return r; }
+    inline void store(float* p) const { for(int i = 0; i < 4; ++i) p[i] = v[i]; }
+#endif
+};
+
+#if VEC2_SSE
+
+inline floatx4 operator + (const floatx4& a, const floatx4& b) { return _mm_add_ps(a.v, b.v); }
+inline floatx4 operator - (const floatx4& a, const floatx4& b) { return _mm_sub_ps(a.v, b.v); }
+inline floatx4 operator * (const floatx4& a, const floatx4& b) { return _mm_mul_ps(a.v, b.v); }
+inline floatx4 min (const floatx4& a, const floatx4& b) { return _mm_min_ps(a.v, b.v); }
+inline floatx4 max (const floatx4& a, const floatx4& b) { return _mm_max_ps(a.v, b.v); }
+
+inline int lessEq (const floatx4& a, const floatx4& b) { return _mm_movemask_ps(_mm_cmple_ps(a.v, b.v)); }
+inline int less (const floatx4& a, const floatx4& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+
+inline floatx4 rsqrt(const floatx4& a)
+{
+    __m128 y = _mm_rsqrt_ps(a.v);
+    __m128 h = _mm_mul_ps(_mm_set1_ps(0.5f), a.v);
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(h, _mm_mul_ps(y, y))));
+}
+
+#elif VEC2_NEON
+
+inline floatx4 operator + (const floatx4& a, const floatx4& b) { return vaddq_f32(a.v, b.v); }
+inline floatx4 operator - (const floatx4& a, const floatx4& b) { return vsubq_f32(a.v, b.v); }
+inline floatx4 operator * (const floatx4& a, const floatx4& b) { return vmulq_f32(a.v, b.v); }
+inline floatx4 min (const floatx4& a, const floatx4& b) { return vminq_f32(a.v, b.v); }
+inline floatx4 max (const floatx4& a, const floatx4& b) { return vmaxq_f32(a.v, b.v); }
+
+// Pairwise adds rather than vaddvq_u32, which ARMv7 lacks.
+inline int movemask(uint32x4_t m)
+{
+    static const uint32_t bits[4] = {1, 2, 4, 8};
+    uint32x4_t v = vandq_u32(m, vld1q_u32(bits));
+    uint32x2_t s = vpadd_u32(vget_low_u32(v), vget_high_u32(v));
+    return (int)vget_lane_u32(vpadd_u32(s, s), 0);
+}
+
+inline int lessEq (const floatx4& a, const floatx4& b) { return movemask(vcleq_f32(a.v, b.v)); }
+inline int less (const floatx4& a, const floatx4& b) { return movemask(vcltq_f32(a.v, b.v)); }
+
+inline floatx4 rsqrt(const floatx4& a)
+{
+    float32x4_t y = vrsqrteq_f32(a.v);
+    return vmulq_f32(y, vrsqrtsq_f32(vmulq_f32(a.v, y), y));
+}
+
+#else
+
+inline floatx4 operator + (const floatx4& a, const floatx4& b) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = a.v[i] + b.v[i]; return r; }
+inline floatx4 operator - (const floatx4& a, const floatx4& b) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = a.v[i] - b.v[i]; return r; }
+inline floatx4 operator * (const floatx4& a, const floatx4& b) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = a.v[i] * b.v[i]; return r; }
+inline floatx4 min (const floatx4& a, const floatx4& b) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = std::min(a.v[i], b.v[i]); return r; }
+inline floatx4 max (const floatx4& a, const floatx4& b) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+
+inline int lessEq (const floatx4& a, const floatx4& b) { int m = 0; for(int i = 0; i < 4; ++i) m |= (a.v[i] <= b.v[i]) << i; return m; }
+inline int less (const floatx4& a, const floatx4& b) { int m = 0; for(int i = 0; i < 4; ++i) m |= (a.v[i] < b.v[i]) << i; return m; }
+
+inline floatx4 rsqrt(const floatx4& a) { floatx4 r; for(int i = 0; i < 4; ++i) r.v[i] = 1.0f / sqrtf(a.v[i]); return r; }
+
+#endif
+
+struct floatx8
+{
+#if VEC2_AVX
+    __m256 v;
+
+    floatx8() {}
+    floatx8(__m256 v) : v(v) {}
+    floatx8(float a) : v(_mm256_set1_ps(a)) {}
+
+    static inline floatx8 load(const float* p) { return _mm256_loadu_ps(p); }
+    inline void store(float* p) const { _mm256_storeu_ps(p, v); }
+#else
+    floatx4 lo;
+    floatx4 hi;
+
+    floatx8() {}
+    floatx8(const floatx4& lo, const floatx4& hi) : lo(lo), hi(hi) {}
+    floatx8(float a) : lo(a), hi(a) {}
+
+    static inline floatx8 load(const float* p) { return floatx8(floatx4::load(p), floatx4::load(p + 4)); }
+    inline void store(float* p) const { lo.store(p); hi.store(p + 4); }
+#endif
+};
+
+#if VEC2_AVX
+
+inline floatx8 operator + (const floatx8& a, const floatx8& b) { return _mm256_add_ps(a.v, b.v); }
+inline floatx8 operator - (const floatx8& a, const floatx8& b) { return _mm256_sub_ps(a.v, b.v); }
+inline floatx8 operator * (const floatx8& a, const floatx8& b) { return _mm256_mul_ps(a.v, b.v); }
+inline floatx8 min (const floatx8& a, const floatx8& b) { return _mm256_min_ps(a.v, b.v); }
+inline floatx8 max (const floatx8& a, const floatx8& b) { return _mm256_max_ps(a.v, b.v); }
+
+inline int lessEq (const floatx8& a, const floatx8& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+inline int less (const floatx8& a, const floatx8& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+
+inline floatx8 rsqrt(const floatx8& a)
+{
+    __m256 y = _mm256_rsqrt_ps(a.v);
+    __m256 h = _mm256_mul_ps(_mm256_set1_ps(0.5f), a.v);
+    return _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.5f), _mm256_mul_ps(h, _mm256_mul_ps(y, y))));
+}
+
+#else
+
+inline floatx8 operator + (const floatx8& a, const floatx8& b) { return floatx8(a.lo + b.lo, a.hi + b.hi); }
+inline floatx8 operator - (const floatx8& a, const floatx8& b) { return floatx8(a.lo - b.lo, a.hi - b.hi); }
+inline floatx8 operator * (const floatx8& a, const floatx8& b) { return floatx8(a.lo * b.lo, a.hi * b.hi); }
+inline floatx8 min (const floatx8& a, const floatx8& b) { return floatx8(min(a.lo, b.lo), min(a.hi, b.hi)); }
+inline floatx8 max (const floatx8& a, const floatx8& b) { return floatx8(max(a.lo, b.lo), max(a.hi, b.hi)); }
+
+inline int lessEq (const floatx8& a, const floatx8& b) { return lessEq(a.lo, b.lo) | (lessEq(a.hi, b.hi) << 4); }
+inline int less (const floatx8& a, const floatx8& b) { return less(a.lo, b.lo) | (less(a.hi, b.hi) << 4); }
+
+inline floatx8 rsqrt(const floatx8& a) { return floatx8(rsqrt(a.lo), rsqrt(a.hi)); }
+
+#endif
+
+template <class F, int W>
+struct vec2xN
+{
+    F x;
+    F y;
+
+    vec2xN() {}
+
+    vec2xN(const F& x, const F& y) : x(x), y(y) {}
+
+    vec2xN(const vec2& p) : x(p.x), y(p.y) {}
+
+    // Deinterleaves W consecutive vec2.
+    static inline vec2xN load(const vec2* p)
+    {
+        float xs[W];
+        float ys[W];
+        for(int i = 0; i < W; ++i) {
+            xs[i] = p[i].x;
+            ys[i] = p[i].y;
+        }
+        return vec2xN(F::load(xs), F::load(ys));
+    }
+
+    // Deinterleaves W vec2 that are `stride` bytes apart, e.g. members of an array of structs.
+    static inline vec2xN load(const vec2* p, size_t stride)
+    {
+        float xs[W];
+        float ys[W];
+        const char* b = (const char*)p;
+        for(int i = 0; i < W; ++i) {
+            const vec2* e = (const vec2*)(b + i * stride);
+            xs[i] = e->x;
+            ys[i] = e->y;
+        }
+        return vec2xN(F::load(xs), F::load(ys));
+    }
+    
+    inline F magSq() const
+    {
+        return x * x + y * y;
+    }
+};
+
+typedef vec2xN<floatx4, 4> vec2x4;
+typedef vec2xN<floatx8, 8> vec2x8;
+
+#if VEC2_SSE
+
+template <>
+inline vec2x4 vec2x4::load(const vec2* p)
+{
+    __m128 a = _mm_loadu_ps(&p[0].x);
+    __m128 b = _mm_loadu_ps(&p[2].x);
+    return vec2x4(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+template <>
+inline vec2x4 vec2x4::load(const vec2* p, size_t stride)
+{
+    const char* c = (const char*)p;
+    __m128 a = _mm_loadh_pi(_mm_castpd_ps(_mm_load_sd((const double*)c)), (const __m64*)(c + stride));
+    __m128 b = _mm_loadh_pi(_mm_castpd_ps(_mm_load_sd((const double*)(c + 2 * stride))), (const __m64*)(c + 3 * stride));
+    return vec2x4(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+#elif VEC2_NEON
+
+template <>
+inline vec2x4 vec2x4::load(const vec2* p)
+{
+    float32x4x2_t v = vld2q_f32(&p[0].x);
+    return vec2x4(v.val[0], v.val[1]);
+}
+
+#endif
+
+template <class F, int W>
+inline vec2xN<F, W> operator + (const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return vec2xN<F, W>(a.x + b.x, a.y + b.y);
+}
+
+template <class F, int W>
+inline vec2xN<F, W> operator - (const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return vec2xN<F, W>(a.x - b.x, a.y - b.y);
+}
+
+template <class F, int W>
+inline F dot(const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
+template <class F, int W>
+inline F distSq(const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return (a - b).magSq();
+}
+
+template <class F, int W>
+inline vec2xN<F, W> min (const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return vec2xN<F, W>(min(a.x, b.x), min(a.y, b.y));
+}
+
+template <class F, int W>
+inline vec2xN<F, W> max (const vec2xN<F, W>& a, const vec2xN<F, W>& b)
+{
+    return vec2xN<F, W>(max(a.x, b.x), max(a.y, b.y));
+}
+
+// Lanes of p inside aabb grown by r.
+template <class F, int W>
+inline int covers(const AABB& aabb, const vec2xN<F, W>& p, float r = 0.0f)
+{
+    return lessEq(F(aabb.lowerBound.x - r), p.x) & lessEq(F(aabb.lowerBound.y - r), p.y) & lessEq(p.x, F(aabb.upperBound.x + r)) & lessEq(p.y, F(aabb.upperBound.y + r));
+}
+
+// Lanes whose box [lower, upper] touches aabb grown by r.
+template <class F, int W>
+inline int touches(const AABB& aabb, const vec2xN<F, W>& lower, const vec2xN<F, W>& upper, float r = 0.0f)
+{
+    return lessEq(lower.x, F(aabb.upperBound.x + r)) & lessEq(lower.y, F(aabb.upperBound.y + r)) & lessEq(F(aabb.lowerBound.x - r), upper.x) & lessEq(F(aabb.lowerBound.y - r), upper.y);
+}
+
+// Four xorshift32 generators side by side.
+struct randx4
+{
+#if VEC2_SSE
+    __m128i s;
+
+    randx4(uint32_t seed) { seed |= 1; s = _mm_set_epi32(seed * 0x9E3779B9u, seed * 0x85EBCA6Bu, seed * 0xC2B2AE35u, seed * 0x27D4EB2Fu); }
+
+    inline floatx4 next()
+    {
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+        s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+        return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(s, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+    }
+#elif VEC2_NEON
+    uint32x4_t s;
+
+    randx4(uint32_t seed) { seed |= 1; uint32_t v[4] = {seed * 0x27D4EB2Fu, seed * 0xC2B2AE35u, seed * 0x85EBCA6Bu, seed * 0x9E3779B9u}; s = vld1q_u32(v); }
+
+    inline floatx4 next()
+    {
+        s = veorq_u32(s, vshlq_n_u32(s, 13));
+        s = veorq_u32(s, vshrq_n_u32(s, 17));
+        s = veorq_u32(s, vshlq_n_u32(s, 5));
+        return vmulq_f32(vcvtq_f32_u32(vshrq_n_u32(s, 8)), vdupq_n_f32(1.0f / 16777216.0f));
+    }
+#else
+    uint32_t s[4];
+
+    randx4(uint32_t seed) { seed |= 1; s[0] = seed * 0x27D4EB2Fu; s[1] = seed * 0xC2B2AE35u; s[2] = seed * 0x85EBCA6Bu; s[3] = seed * 0x9E3779B9u; }
+
+    inline floatx4 next()
+    {
+        floatx4 r;
+        for(int i = 0; i < 4; ++i) {
+            s[i] ^= s[i] << 13;
+            s[i] ^= s[i] >> 17;
+            s[i] ^= s[i] << 5;
+            r.v[i] = (s[i] >> 8) * (1.0f / 16777216.0f);
+        }
+        return r;
+    }
+#endif
+
+    // Uniform in [a, b).
+    inline floatx4 next(float a, float b)
+    {
+        return next() * floatx4(b - a) + floatx4(a);
+    }
+};
+
+#endif /* vec2simd_h */